@@ -5,7 +5,17 @@
 /* -*- c-default-style: "k&r" -*- */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "lmdb.h"
 
@@ -15,6 +25,8 @@
 
 #if LUA_VERSION_NUM<=501
 # define lua_type_error luaL_typerror
+# define lua_tointegerx(L,i,isnum) (*(isnum) = lua_isnumber(L,i),lua_tointeger(L,i))
+# define lua_absindex(L,i) ((i)>0 || (i)<=LUA_REGISTRYINDEX ? (i) : lua_gettop(L)+(i)+1)
 void lua_set_funcs(lua_State *L, const char *libname,const luaL_Reg *l) {
   lua_setglobal(L,libname);
   luaL_register(L,libname,l);
@@ -37,6 +49,7 @@ int lua_type_error(lua_State *L,int narg,const char *tname) {
 #define ENV "lightningmdb_env"
 #define TXN "lightningmdb_txn"
 #define CURSOR "lightningmdb_cursor"
+#define SHARDED "lightningmdb_sharded"
 
 #define setfield_enum(x) lua_pushinteger(L,x); lua_setfield(L,-2,#x)
 
@@ -49,11 +62,124 @@ int lua_type_error(lua_State *L,int narg,const char *tname) {
     lua_set_funcs(L,X,x##_methods);                                   \
   }
 
-#define set_meta_and_return(x,X)                            \
-  *(MDB_##x **)(lua_newuserdata(L,sizeof(MDB_##x *))) = x;  \
-  luaL_getmetatable(L,X);                                   \
-  lua_setmetatable(L,-2);                                   \
-  return 1;
+#define CHANGES_DBI_NAME "__lightningmdb_changes"
+#define TTL_DBI_NAME "__lightningmdb_ttl"
+#define TTL_KEYS_DBI_NAME "__lightningmdb_ttl_keys"
+#define TTL_KEY_MAX 1024
+
+/*
+ * writes are tracked per dbi slot, with all the dbis beyond the last slot
+ * sharing it.
+ */
+#define DBI_SLOTS 32
+#define dbi_slot(dbi) ((dbi)<DBI_SLOTS ? (dbi) : DBI_SLOTS-1)
+#define FREE_DBI 0
+#define MAIN_DBI 1
+
+/*
+ * per env state, attached to the MDB_env through mdb_env_set_userctx so it is
+ * reachable from any txn or cursor.
+ */
+typedef struct env_ctx {
+  int capture;
+  MDB_dbi changes_dbi;
+  int ttl;
+  MDB_dbi ttl_dbi;
+  MDB_dbi ttl_keys_dbi;
+  int wrapped;            /* handles were given to lightningmdb.ffi */
+  /*
+   * id of the last txn writing to each dbi slot, and the id up to which all
+   * the commits are accounted for (commits of other processes are not).
+   */
+  pthread_mutex_t lock;
+  size_t written[DBI_SLOTS];
+  size_t seen_txnid;
+  /* names of the dbis opened through txn:dbi_open, by handle */
+  char** names;
+  size_t nnames;
+  /* shared envs only, guarded by shared_envs_lock */
+  MDB_env* env;
+  char* path;
+  int refs;
+  struct env_ctx* next;
+} env_ctx;
+
+/* read cache of hot keys, kept per Lua state as it holds Lua strings */
+typedef struct {
+  MDB_dbi dbi;
+  unsigned int hash;
+  size_t snap;      /* id of the snapshot the value was read from */
+  int ref;          /* registry ref of the value, LUA_NOREF when free */
+  int next;         /* hash chain */
+  int used;         /* CLOCK reference bit */
+  size_t klen;
+  char* key;
+} cache_entry;
+
+typedef struct {
+  int capacity;
+  int size;
+  int hand;
+  int nbuckets;
+  int* buckets;
+  cache_entry* entries;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  size_t invalidations;
+  /*
+   * held by the env and by every txn using the cache. Once the env lets go
+   * the entries are freed and the txns still holding it stop using it.
+   */
+  int refs;
+  int dead;
+} hot_cache;
+
+/*
+ * env, txn and cursor userdata. The MDB_ handle must remain the first member
+ * so that check_env/check_txn/check_cursor keep working on them.
+ */
+typedef struct {
+  MDB_env* env;
+  hot_cache* cache;
+} env_ud;
+
+/* a chunk of a txn's scratch memory, followed by the memory itself */
+typedef struct scratch_chunk {
+  struct scratch_chunk* next;
+  size_t size;
+  size_t used;
+} scratch_chunk;
+
+typedef struct {
+  scratch_chunk* chunk;
+  size_t used;
+} scratch_mark;
+
+typedef struct txn_ud {
+  MDB_txn* txn;
+  struct txn_ud* parent;
+  int parent_ref;         /* keeps the parent userdata alive */
+  struct txn_ud* child;   /* the open nested txn, if any */
+  env_ctx* ctx;
+  hot_cache* cache;
+  int rdonly;
+  int depth;              /* of nesting, 0 for top level txns */
+  unsigned long touched;  /* dbi slots written to */
+  char* changes;
+  size_t changes_len;
+  size_t changes_cap;
+  scratch_chunk* scratch;
+} txn_ud;
+
+typedef struct {
+  MDB_cursor* cursor;
+  txn_ud* txn;
+  int txn_ref;        /* keeps the txn userdata alive */
+  size_t readahead;   /* bytes to advise ahead of a scan, 0 when off */
+  char* advised_from;
+  char* advised_to;
+} cursor_ud;
 
 
 static int clean_metatable(lua_State* L) {
@@ -104,6 +230,282 @@ DEFINE_check(env,ENV)
 DEFINE_check(txn,TXN)
 DEFINE_check(cursor,CURSOR)
 
+static env_ud* check_env_ud(lua_State *L, int index) {
+  check_env(L,index);
+  return (env_ud*)lua_touserdata(L,index);
+}
+
+static txn_ud* check_txn_ud(lua_State *L, int index) {
+  check_txn(L,index);
+  return (txn_ud*)lua_touserdata(L,index);
+}
+
+static cursor_ud* check_cursor_ud(lua_State *L, int index) {
+  check_cursor(L,index);
+  return (cursor_ud*)lua_touserdata(L,index);
+}
+
+static env_ctx* env_ctx_new(void) {
+  env_ctx* ctx = (env_ctx*)calloc(1,sizeof(env_ctx));
+  if ( ctx ) {
+    pthread_mutex_init(&ctx->lock,NULL);
+  }
+  return ctx;
+}
+
+static void env_ctx_free(env_ctx* ctx) {
+  size_t i;
+  if ( ctx ) {
+    for (i=0; i<ctx->nnames; ++i) {
+      free(ctx->names[i]);
+    }
+    free(ctx->names);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx->path);
+    free(ctx);
+  }
+}
+
+static env_ctx* get_env_ctx(MDB_env* env,int create) {
+  env_ctx* ctx = (env_ctx*)mdb_env_get_userctx(env);
+  if ( !ctx && create ) {
+    ctx = env_ctx_new();
+    if ( ctx ) {
+      mdb_env_set_userctx(env,ctx);
+    }
+  }
+  return ctx;
+}
+
+static void env_ctx_set_name(env_ctx* ctx,MDB_dbi dbi,const char* name) {
+  char** names;
+  pthread_mutex_lock(&ctx->lock);
+  if ( dbi>=ctx->nnames ) {
+    names = (char**)realloc(ctx->names,sizeof(char*)*(dbi+1));
+    if ( names ) {
+      memset(names+ctx->nnames,0,sizeof(char*)*(dbi+1-ctx->nnames));
+      ctx->names = names;
+      ctx->nnames = dbi+1;
+    }
+  }
+  if ( dbi<ctx->nnames ) {
+    free(ctx->names[dbi]);
+    ctx->names[dbi] = name ? strdup(name) : NULL;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static env_ud* push_env(lua_State *L,MDB_env* env) {
+  env_ud* e = (env_ud*)lua_newuserdata(L,sizeof(env_ud));
+  e->env = env;
+  e->cache = NULL;
+  luaL_getmetatable(L,ENV);
+  lua_setmetatable(L,-2);
+  return e;
+}
+
+/*
+ * children point at the userdata of their parent txn, which is referenced from
+ * the registry until they end, so that the collector can't free it under them.
+ */
+static int anchor(lua_State* L,int index) {
+  if ( !index ) {
+    return LUA_NOREF;
+  }
+  lua_pushvalue(L,index);
+  return luaL_ref(L,LUA_REGISTRYINDEX);
+}
+
+static void unanchor(lua_State* L,int* ref) {
+  luaL_unref(L,LUA_REGISTRYINDEX,*ref);
+  *ref = LUA_NOREF;
+}
+
+/* parent is the stack index of the parent txn, 0 for none */
+static txn_ud* push_txn(lua_State *L,MDB_txn* txn,int parent) {
+  txn_ud* t;
+  parent = parent ? lua_absindex(L,parent) : 0;
+  t = (txn_ud*)lua_newuserdata(L,sizeof(txn_ud));
+  memset(t,0,sizeof(txn_ud));
+  t->txn = txn;
+  t->parent = parent ? (txn_ud*)lua_touserdata(L,parent) : NULL;
+  t->parent_ref = anchor(L,parent);
+  if ( t->parent ) {
+    t->parent->child = t;
+  }
+  t->ctx = get_env_ctx(mdb_txn_env(txn),0);
+  luaL_getmetatable(L,TXN);
+  lua_setmetatable(L,-2);
+  return t;
+}
+
+/* t is the stack index of the txn the cursor belongs to */
+static cursor_ud* push_cursor(lua_State *L,MDB_cursor* cursor,int t) {
+  cursor_ud* c;
+  t = lua_absindex(L,t);
+  c = (cursor_ud*)lua_newuserdata(L,sizeof(cursor_ud));
+  memset(c,0,sizeof(cursor_ud));
+  c->cursor = cursor;
+  c->txn = (txn_ud*)lua_touserdata(L,t);
+  c->txn_ref = anchor(L,t);
+  luaL_getmetatable(L,CURSOR);
+  lua_setmetatable(L,-2);
+  return c;
+}
+
+static void txn_touch(txn_ud* t,MDB_dbi dbi) {
+  t->touched |= 1UL<<dbi_slot(dbi);
+}
+
+/*
+ * called, while holding the write lock, right before txn id is committed, so
+ * that no reader may see the new data along with the old written ids.
+ */
+static void env_ctx_committing(env_ctx* ctx,size_t id,unsigned long touched) {
+  int i;
+  pthread_mutex_lock(&ctx->lock);
+  for (i=0; i<DBI_SLOTS; ++i) {
+    if ( ctx->seen_txnid!=id-1 || (touched & (1UL<<i)) ) {
+      ctx->written[i] = id;
+    }
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+static void env_ctx_committed(env_ctx* ctx,size_t id) {
+  pthread_mutex_lock(&ctx->lock);
+  if ( ctx->seen_txnid<id ) {
+    ctx->seen_txnid = id;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+/* returns the id of the last txn which wrote to dbi, as seen by snap */
+static size_t env_ctx_written(env_ctx* ctx,MDB_dbi dbi,size_t snap) {
+  size_t written;
+  int i;
+  pthread_mutex_lock(&ctx->lock);
+  if ( snap>ctx->seen_txnid ) {
+    /* someone else committed, we can't tell which dbis were changed */
+    for (i=0; i<DBI_SLOTS; ++i) {
+      ctx->written[i] = snap;
+    }
+    ctx->seen_txnid = snap;
+  }
+  written = ctx->written[dbi_slot(dbi)];
+  pthread_mutex_unlock(&ctx->lock);
+  return written;
+}
+
+/*
+ * scratch memory for the temporary buffers of a txn's operations, saving them
+ * from both the Lua GC and a malloc per buffer. It is a bump allocator, which
+ * can be rewound to a mark, and is freed as a whole when the txn ends.
+ */
+#define SCRATCH_CHUNK 8192
+#define SCRATCH_ALIGN 16
+#define SCRATCH_HEADER \
+  ((sizeof(scratch_chunk)+SCRATCH_ALIGN-1) & ~(size_t)(SCRATCH_ALIGN-1))
+
+static size_t scratch_round(size_t size) {
+  return (size+SCRATCH_ALIGN-1) & ~(size_t)(SCRATCH_ALIGN-1);
+}
+
+static void* scratch_alloc(txn_ud* t,size_t size) {
+  scratch_chunk* c = t->scratch;
+  size_t n = scratch_round(size);
+  void* p;
+  if ( !c || c->size-c->used<n ) {
+    size_t chunk = c ? 2*c->size : SCRATCH_CHUNK;
+    if ( chunk<n ) {
+      chunk = n;
+    }
+    c = (scratch_chunk*)malloc(SCRATCH_HEADER+chunk);
+    if ( !c ) {
+      return NULL;
+    }
+    c->next = t->scratch;
+    c->size = chunk;
+    c->used = 0;
+    t->scratch = c;
+  }
+  p = (char*)c+SCRATCH_HEADER+c->used;
+  c->used += n;
+  return p;
+}
+
+/* resizes the block p, in place when it is the last one allocated */
+static void* scratch_grow(txn_ud* t,void* p,size_t old,size_t size) {
+  scratch_chunk* c = t->scratch;
+  size_t o = scratch_round(old);
+  size_t n = scratch_round(size);
+  void* q;
+  if ( p && c && (char*)p+o==(char*)c+SCRATCH_HEADER+c->used &&
+       c->size-c->used+o>=n ) {
+    c->used = c->used-o+n;
+    return p;
+  }
+  q = scratch_alloc(t,size);
+  if ( q && p ) {
+    memcpy(q,p,old<size ? old : size);
+  }
+  return q;
+}
+
+static scratch_mark scratch_save(txn_ud* t) {
+  scratch_mark m;
+  m.chunk = t->scratch;
+  m.used = t->scratch ? t->scratch->used : 0;
+  return m;
+}
+
+/*
+ * frees everything allocated since the mark was saved. Rewinding to a mark of
+ * an empty area keeps the latest (and largest) chunk for the next operations.
+ */
+static void scratch_rewind(txn_ud* t,scratch_mark m) {
+  scratch_chunk* keep = m.chunk ? NULL : t->scratch;
+  if ( keep ) {
+    t->scratch = keep->next;
+    keep->next = NULL;
+  }
+  while ( t->scratch && t->scratch!=m.chunk ) {
+    scratch_chunk* next = t->scratch->next;
+    free(t->scratch);
+    t->scratch = next;
+  }
+  if ( keep ) {
+    t->scratch = keep;
+  }
+  if ( t->scratch ) {
+    t->scratch->used = m.used;
+  }
+}
+
+static void scratch_free(txn_ud* t) {
+  scratch_chunk* next;
+  while ( t->scratch ) {
+    next = t->scratch->next;
+    free(t->scratch);
+    t->scratch = next;
+  }
+}
+
+static void cache_unref(hot_cache* c) {
+  if ( c && --c->refs==0 ) {
+    free(c);
+  }
+}
+
+static void txn_ud_release(txn_ud* t) {
+  cache_unref(t->cache);
+  t->cache = NULL;
+  free(t->changes);
+  t->changes = NULL;
+  t->changes_len = t->changes_cap = 0;
+  scratch_free(t);
+}
+
 static int stat_to_table(lua_State *L,MDB_stat *stat) {
   lua_newtable(L);
   lua_pushinteger(L,stat->ms_psize);
@@ -122,6 +524,17 @@ static int stat_to_table(lua_State *L,MDB_stat *stat) {
 }
 
 
+static lua_Integer opt_field(lua_State *L,int index,const char* name,
+                             lua_Integer def) {
+  lua_Integer x = def;
+  lua_getfield(L,index,name);
+  if ( !lua_isnil(L,-1) ) {
+    x = luaL_checkinteger(L,-1);
+  }
+  lua_pop(L,1);
+  return x;
+}
+
 static MDB_val* pop_val(lua_State* L,int index,MDB_val* val) {
   if ( lua_isnil(L,index) ) {
     return NULL;
@@ -130,492 +543,3534 @@ static MDB_val* pop_val(lua_State* L,int index,MDB_val* val) {
   return val;
 }
 
-/* env */
-static int env_open(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  const char* path = luaL_checkstring(L,2);
-  mode_t flags = (mode_t)luaL_checkinteger(L,3);
-  int mode = luaL_checkinteger(L,4);
-  int err;
+/* change capture */
 
-  if ( !path ) {
-    return str_error_and_out(L,"path required");
-  }
-  err = mdb_env_open(env,path,flags,mode);
-  return success_or_err(L,err);
+/*
+ * every committed write txn appends a single record to the changes dbi. The
+ * key is a big endian sequence number (the txn id, bumped if needed to keep
+ * the keys increasing) and the value is the big endian txn id followed by the
+ * txn's changes, each being
+ *   op ('p' or 'd') | dbi (u32) | name len (u32) | name | key len (u32) | key |
+ *   val len (u32) | val
+ * with a val len of CHANGE_NO_VALUE for dels without a value. The name is the
+ * dbi's, as handles are only meaningful within a process, empty for the main
+ * dbi and with a len of CHANGE_NO_VALUE for dbis not opened by txn:dbi_open.
+ * Drops are recorded with a 'D' op, an empty key and a single byte val which
+ * is 1 when the dbi was deleted and 0 otherwise.
+ */
+#define CHANGE_NO_VALUE 0xffffffffu
+
+static void put_u32(unsigned char* p,size_t x) {
+  p[0] = (x>>24) & 0xff;
+  p[1] = (x>>16) & 0xff;
+  p[2] = (x>>8) & 0xff;
+  p[3] = x & 0xff;
 }
 
-static int env_copy(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  const char* path = luaL_checkstring(L,2);
-  int err;
+static size_t get_u32(const unsigned char* p) {
+  return ((size_t)p[0]<<24) | ((size_t)p[1]<<16) | ((size_t)p[2]<<8) | p[3];
+}
 
-  if ( !path ) {
-    return str_error_and_out(L,"path required");
+static void put_u64(unsigned char* p,uint64_t x) {
+  int i;
+  for (i=7; i>=0; --i) {
+    p[i] = x & 0xff;
+    x >>= 8;
   }
-  err = mdb_env_copy(env,path);
-  return success_or_err(L,err);
 }
 
-static int env_stat(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  MDB_stat stat;
-  mdb_env_stat(env,&stat);
-  return stat_to_table(L,&stat);
+static uint64_t get_u64(const unsigned char* p) {
+  uint64_t x = 0;
+  int i;
+  for (i=0; i<8; ++i) {
+    x = (x<<8) | p[i];
+  }
+  return x;
 }
 
-static int env_info(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  MDB_envinfo info;
-  mdb_env_info(env,&info);
-  lua_newtable(L);
-
-  lua_pushinteger(L,info.me_mapsize);
-  lua_setfield(L,-2,"me_mapsize");
-  lua_pushinteger(L,info.me_last_pgno);
-  lua_setfield(L,-2,"me_last_pgno");
-  lua_pushinteger(L,info.me_last_txnid);
-  lua_setfield(L,-2,"me_last_txnid");
-  lua_pushinteger(L,info.me_maxreaders);
-  lua_setfield(L,-2,"me_maxreaders");
-  lua_pushinteger(L,info.me_numreaders);
-  lua_setfield(L,-2,"me_numreaders");
-  return 1;
-
+static int changes_reserve(txn_ud* t,size_t more) {
+  size_t cap = t->changes_cap ? t->changes_cap : 256;
+  char* p;
+  if ( t->changes_len+more<=t->changes_cap ) {
+    return 0;
+  }
+  while ( cap<t->changes_len+more ) {
+    cap *= 2;
+  }
+  p = (char*)realloc(t->changes,cap);
+  if ( !p ) {
+    return ENOMEM;
+  }
+  t->changes = p;
+  t->changes_cap = cap;
+  return 0;
 }
 
-static int env_sync(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  int force = luaL_checkinteger(L,2);
-  int err = mdb_env_sync(env,force);
-  return success_or_err(L,err);
+static int txn_record(txn_ud* t,char op,MDB_dbi dbi,MDB_val* k,MDB_val* v) {
+  env_ctx* ctx = t->ctx;
+  const char* name = NULL;
+  size_t name_len = 0;
+  unsigned char* p;
+  if ( !ctx || !ctx->capture || dbi==ctx->changes_dbi ) {
+    return 0;
+  }
+  pthread_mutex_lock(&ctx->lock);
+  if ( dbi==MAIN_DBI ) {
+    name = "";
+  } else if ( dbi<ctx->nnames ) {
+    name = ctx->names[dbi];
+  }
+  name_len = name ? strlen(name) : 0;
+  if ( changes_reserve(t,17+name_len+k->mv_size+(v ? v->mv_size : 0)) ) {
+    pthread_mutex_unlock(&ctx->lock);
+    return ENOMEM;
+  }
+  p = (unsigned char*)t->changes+t->changes_len;
+  *p++ = op;
+  put_u32(p,dbi);
+  p += 4;
+  put_u32(p,name ? name_len : CHANGE_NO_VALUE);
+  p += 4;
+  if ( name ) {
+    memcpy(p,name,name_len);
+    p += name_len;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  put_u32(p,k->mv_size);
+  p += 4;
+  memcpy(p,k->mv_data,k->mv_size);
+  p += k->mv_size;
+  put_u32(p,v ? v->mv_size : CHANGE_NO_VALUE);
+  p += 4;
+  if ( v ) {
+    memcpy(p,v->mv_data,v->mv_size);
+    p += v->mv_size;
+  }
+  t->changes_len = (char*)p-t->changes;
+  return 0;
 }
 
-static int env_close(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  mdb_env_close(env);
-  clean_metatable(L);
+/* a committed nested txn hands its changes over to its parent */
+static int changes_merge(txn_ud* parent,txn_ud* child) {
+  if ( !child->changes_len ) {
+    return 0;
+  }
+  if ( changes_reserve(parent,child->changes_len) ) {
+    return ENOMEM;
+  }
+  memcpy(parent->changes+parent->changes_len,child->changes,child->changes_len);
+  parent->changes_len += child->changes_len;
   return 0;
 }
 
-static int env_set_flags(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  unsigned int flags = luaL_checkinteger(L,2);
-  int onoff = luaL_checkinteger(L,3);
-  int err = mdb_env_set_flags(env,flags,onoff);
-  return success_or_err(L,err);
-}
+static int changes_flush(txn_ud* t) {
+  MDB_cursor* cursor;
+  MDB_val k,v;
+  unsigned char seq[8];
+  size_t id = mdb_txn_id(t->txn);
+  int err;
 
-static int env_get_flags(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  unsigned int flags = 0;
-  int err = mdb_env_get_flags(env,&flags);
+  if ( !t->changes_len ) {
+    return 0;
+  }
+  txn_touch(t,t->ctx->changes_dbi);
+  err = mdb_cursor_open(t->txn,t->ctx->changes_dbi,&cursor);
   if ( err ) {
-    return error_and_out(L,err);
+    return err;
   }
-  lua_pushinteger(L,flags);
-  return 1;
-}
+  err = mdb_cursor_get(cursor,&k,&v,MDB_LAST);
+  if ( err==0 && k.mv_size==8 && get_u64(k.mv_data)>=id ) {
+    /* txn ids restart after a compacting copy, the sequence must not */
+    put_u64(seq,get_u64(k.mv_data)+1);
+  } else {
+    put_u64(seq,id);
+  }
+  mdb_cursor_close(cursor);
 
-static int env_get_path(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  const char* path;
-  int err = mdb_env_get_path(env,&path);
+  k.mv_data = seq;
+  k.mv_size = 8;
+  v.mv_size = 8+t->changes_len;
+  err = mdb_put(t->txn,t->ctx->changes_dbi,&k,&v,MDB_APPEND|MDB_RESERVE);
   if ( err ) {
-    return error_and_out(L,err);
+    return err;
   }
-  lua_pushstring(L,path);
-  return 1;
+  put_u64(v.mv_data,id);
+  memcpy((char*)v.mv_data+8,t->changes,t->changes_len);
+  return 0;
 }
 
-static int env_set_mapsize(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  size_t size = luaL_checkinteger(L,2);
-  int err = mdb_env_set_mapsize(env,size);
-  return success_or_err(L,err);
+static int changes_to_table(lua_State* L,const unsigned char* p,size_t len) {
+  const unsigned char* end = p+len;
+  size_t nlen,klen,vlen;
+  char op;
+  int i = 0;
+  lua_newtable(L);
+  while ( p<end ) {
+    if ( end-p<9 ) {
+      return -1;
+    }
+    lua_newtable(L);
+    op = *p;
+    lua_pushstring(L,op=='p' ? "put" : op=='D' ? "drop" : "del");
+    lua_setfield(L,-2,"op");
+    lua_pushinteger(L,get_u32(p+1));
+    lua_setfield(L,-2,"dbi");
+    nlen = get_u32(p+5);
+    p += 9;
+    if ( nlen!=CHANGE_NO_VALUE ) {
+      if ( (size_t)(end-p)<nlen ) {
+        return -1;
+      }
+      lua_pushlstring(L,(const char*)p,nlen);
+      lua_setfield(L,-2,"name");
+      p += nlen;
+    }
+    if ( end-p<4 ) {
+      return -1;
+    }
+    klen = get_u32(p);
+    p += 4;
+    if ( (size_t)(end-p)<klen+4 ) {
+      return -1;
+    }
+    lua_pushlstring(L,(const char*)p,klen);
+    lua_setfield(L,-2,"key");
+    p += klen;
+    vlen = get_u32(p);
+    p += 4;
+    if ( vlen!=CHANGE_NO_VALUE ) {
+      if ( (size_t)(end-p)<vlen ) {
+        return -1;
+      }
+      if ( op=='D' ) {
+        lua_pushboolean(L,vlen>0 && *p);
+        lua_setfield(L,-2,"del");
+      } else {
+        lua_pushlstring(L,(const char*)p,vlen);
+        lua_setfield(L,-2,"value");
+      }
+      p += vlen;
+    }
+    lua_rawseti(L,-2,++i);
+  }
+  return 0;
 }
 
-static int env_set_maxreaders(lua_State *L) {
-  /* TODO */
-  return unimplemented(L);
+static int txn_commit_ud(txn_ud* t) {
+  env_ctx* ctx = get_env_ctx(mdb_txn_env(t->txn),0);
+  size_t id = mdb_txn_id(t->txn);
+  txn_ud* child = t->child;
+  int err = 0;
+
+  /*
+   * LMDB would commit an open nested txn implicitly, skipping its changes and
+   * touched dbis, so it is committed here first (and its own nested txn before
+   * it), leaving its userdata without a txn.
+   */
+  if ( child ) {
+    err = txn_commit_ud(child);
+    child->txn = NULL;
+    t->child = NULL;
+  }
+  if ( !err && !t->parent ) {
+    err = changes_flush(t);
+  }
+  if ( err ) {
+    /* fail like mdb_txn_commit does, leaving no txn behind */
+    mdb_txn_abort(t->txn);
+    txn_ud_release(t);
+    return err;
+  }
+  if ( ctx && !t->parent && t->touched ) {
+    env_ctx_committing(ctx,id,t->touched);
+  }
+  err = mdb_txn_commit(t->txn);
+  if ( !err && t->parent ) {
+    t->parent->touched |= t->touched;
+    err = changes_merge(t->parent,t);
+  } else if ( !err && ctx && t->touched ) {
+    env_ctx_committed(ctx,id);
+  }
+  txn_ud_release(t);
+  return err;
 }
 
-static int env_get_maxreaders(lua_State *L) {
-  /* TODO */
-  return unimplemented(L);
+/* key expiry */
+
+/*
+ * expiring keys are indexed by two hidden dbis, both keyed by the key's dbi
+ * name and the key itself (name \0 key). The expiry dbi prefixes it with the
+ * big endian expiry time, so it is ordered by expiry, and the keys dbi maps it
+ * to the expiry time. Dbis are referred to by name, as handles are only
+ * meaningful within a process.
+ */
+static int ttl_active(txn_ud* t,MDB_dbi dbi) {
+  return t->ctx && t->ctx->ttl &&
+    dbi!=t->ctx->ttl_dbi && dbi!=t->ctx->ttl_keys_dbi;
 }
 
-static int env_set_maxdbs(lua_State *L) {
-  MDB_env* env = check_env(L,1);
-  int num = luaL_checkinteger(L,2);
-  int err = mdb_env_set_maxdbs(env,num);
-  return success_or_err(L,err);
+/* places name \0 key in buf+8, leaving room for the expiry time */
+static int ttl_key(env_ctx* ctx,MDB_dbi dbi,MDB_val* k,unsigned char* buf,
+                   size_t* size) {
+  const char* name = NULL;
+  int err = 0;
+  pthread_mutex_lock(&ctx->lock);
+  if ( dbi==MAIN_DBI ) {
+    name = "";
+  } else if ( dbi<ctx->nnames ) {
+    name = ctx->names[dbi];
+  }
+  if ( !name ) {
+    err = MDB_BAD_DBI;
+  } else if ( 8+strlen(name)+1+k->mv_size>TTL_KEY_MAX ) {
+    err = MDB_BAD_VALSIZE;
+  } else {
+    *size = strlen(name)+1+k->mv_size;
+    memcpy(buf+8,name,strlen(name)+1);
+    memcpy(buf+8+strlen(name)+1,k->mv_data,k->mv_size);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  return err;
 }
 
-static int env_txn_begin(lua_State* L) {
-  MDB_env* env = check_env(L,1);
-  MDB_txn* parent = lua_isnil(L,2) ? NULL : check_txn(L,2);
-  unsigned int flags = luaL_checkinteger(L,3);
+static int ttl_forget(txn_ud* t,MDB_dbi dbi,MDB_val* k) {
+  unsigned char buf[TTL_KEY_MAX];
+  MDB_val fk,ik,v;
   int err;
-  MDB_txn* txn;
-  if ( !env ) {
-    return str_error_and_out(L,"bad params");
+  if ( !ttl_active(t,dbi) || ttl_key(t->ctx,dbi,k,buf,&fk.mv_size) ) {
+    return 0;
+  }
+  fk.mv_data = buf+8;
+  err = mdb_get(t->txn,t->ctx->ttl_keys_dbi,&fk,&v);
+  if ( err ) {
+    return err==MDB_NOTFOUND ? 0 : err;
+  }
+  if ( v.mv_size!=8 ) {
+    return MDB_CORRUPTED;
   }
+  memcpy(buf,v.mv_data,8);
+  ik.mv_data = buf;
+  ik.mv_size = fk.mv_size+8;
+  txn_touch(t,t->ctx->ttl_dbi);
+  txn_touch(t,t->ctx->ttl_keys_dbi);
+  err = mdb_del(t->txn,t->ctx->ttl_dbi,&ik,NULL);
+  if ( err==0 || err==MDB_NOTFOUND ) {
+    err = mdb_del(t->txn,t->ctx->ttl_keys_dbi,&fk,NULL);
+  }
+  return err==MDB_NOTFOUND ? 0 : err;
+}
 
-  err = mdb_txn_begin(env,parent,flags,&txn);
+static int ttl_set(txn_ud* t,MDB_dbi dbi,MDB_val* k,uint64_t expiry) {
+  unsigned char buf[TTL_KEY_MAX];
+  MDB_val fk,ik,v;
+  int err;
+  if ( !ttl_active(t,dbi) ) {
+    return MDB_INCOMPATIBLE;
+  }
+  err = ttl_key(t->ctx,dbi,k,buf,&fk.mv_size);
+  if ( !err ) {
+    err = ttl_forget(t,dbi,k);
+  }
   if ( err ) {
-    return error_and_out(L,err);
+    return err;
   }
-  set_meta_and_return(txn,TXN);
+  put_u64(buf,expiry);
+  fk.mv_data = buf+8;
+  ik.mv_data = buf;
+  ik.mv_size = fk.mv_size+8;
+  v.mv_data = buf;
+  v.mv_size = 0;
+  err = mdb_put(t->txn,t->ctx->ttl_dbi,&ik,&v,0);
+  if ( !err ) {
+    v.mv_size = 8;
+    err = mdb_put(t->txn,t->ctx->ttl_keys_dbi,&fk,&v,0);
+  }
+  return err;
 }
 
-static int env_dbi_close(lua_State* L) {
-  MDB_env* env = check_env(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
+/*
+ * gets skip the lookup while the txn's snapshot of the index is empty, which
+ * holds for the expiring keys of all the processes.
+ */
+static int ttl_expired(txn_ud* t,MDB_dbi dbi,MDB_val* k) {
+  unsigned char buf[TTL_KEY_MAX];
+  MDB_stat stat;
+  MDB_val fk,v;
+  if ( !ttl_active(t,dbi) ||
+       mdb_stat(t->txn,t->ctx->ttl_keys_dbi,&stat) || !stat.ms_entries ||
+       ttl_key(t->ctx,dbi,k,buf,&fk.mv_size) ) {
+    return 0;
+  }
+  fk.mv_data = buf+8;
+  return mdb_get(t->txn,t->ctx->ttl_keys_dbi,&fk,&v)==0 && v.mv_size==8 &&
+    get_u64(v.mv_data)<=(uint64_t)time(NULL);
+}
 
-  mdb_dbi_close(env,dbi);
-  return 0;
+/* forgets the expiry of k once none of its values are left */
+static int ttl_forget_if_gone(txn_ud* t,MDB_dbi dbi,MDB_val* k) {
+  MDB_val v;
+  if ( !ttl_active(t,dbi) || mdb_get(t->txn,dbi,k,&v)!=MDB_NOTFOUND ) {
+    return 0;
+  }
+  return ttl_forget(t,dbi,k);
 }
 
+/* hot key cache */
+static unsigned int cache_hash(MDB_dbi dbi,MDB_val* k) {
+  const unsigned char* p = (const unsigned char*)k->mv_data;
+  unsigned int h = 2166136261u ^ dbi;
+  size_t i;
+  for (i=0; i<k->mv_size; ++i) {
+    h = (h ^ p[i])*16777619u;
+  }
+  return h;
+}
+
+static hot_cache* cache_new(int capacity) {
+  hot_cache* c = (hot_cache*)calloc(1,sizeof(hot_cache));
+  int i;
+  if ( !c ) {
+    return NULL;
+  }
+  c->capacity = capacity;
+  c->nbuckets = capacity*2;
+  c->buckets = (int*)malloc(sizeof(int)*c->nbuckets);
+  c->entries = (cache_entry*)calloc(capacity,sizeof(cache_entry));
+  if ( !c->buckets || !c->entries ) {
+    free(c->buckets);
+    free(c->entries);
+    free(c);
+    return NULL;
+  }
+  for (i=0; i<c->nbuckets; ++i) {
+    c->buckets[i] = -1;
+  }
+  for (i=0; i<capacity; ++i) {
+    c->entries[i].ref = LUA_NOREF;
+  }
+  c->refs = 1;
+  return c;
+}
+
+/* drops the env's reference to the cache, along with all its entries */
+static void cache_free(lua_State* L,hot_cache* c) {
+  int i;
+  if ( !c ) {
+    return;
+  }
+  for (i=0; i<c->capacity; ++i) {
+    luaL_unref(L,LUA_REGISTRYINDEX,c->entries[i].ref);
+    free(c->entries[i].key);
+  }
+  free(c->buckets);
+  free(c->entries);
+  c->buckets = NULL;
+  c->entries = NULL;
+  c->size = c->capacity = 0;
+  c->dead = 1;
+  cache_unref(c);
+}
+
+static int cache_find(hot_cache* c,MDB_dbi dbi,unsigned int h,MDB_val* k) {
+  int i;
+  for (i=c->buckets[h%c->nbuckets]; i>=0; i=c->entries[i].next) {
+    cache_entry* e = &c->entries[i];
+    if ( e->hash==h && e->dbi==dbi && e->klen==k->mv_size &&
+         memcmp(e->key,k->mv_data,k->mv_size)==0 ) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void cache_drop(lua_State* L,hot_cache* c,int i) {
+  cache_entry* e = &c->entries[i];
+  int* p = &c->buckets[e->hash%c->nbuckets];
+  while ( *p!=i ) {
+    p = &c->entries[*p].next;
+  }
+  *p = e->next;
+  luaL_unref(L,LUA_REGISTRYINDEX,e->ref);
+  free(e->key);
+  e->key = NULL;
+  e->ref = LUA_NOREF;
+  --c->size;
+}
+
+/* caches the value on top of the stack, leaving it there */
+static void cache_insert(lua_State* L,hot_cache* c,MDB_dbi dbi,unsigned int h,
+                         MDB_val* k,size_t snap) {
+  cache_entry* e;
+  char* key = (char*)malloc(k->mv_size ? k->mv_size : 1);
+  int i;
+  if ( !key ) {
+    return;
+  }
+  /* CLOCK: give the entries referenced since the last sweep another round */
+  for (;;) {
+    i = c->hand;
+    c->hand = (c->hand+1)%c->capacity;
+    e = &c->entries[i];
+    if ( e->ref==LUA_NOREF ) {
+      break;
+    }
+    if ( !e->used ) {
+      cache_drop(L,c,i);
+      ++c->evictions;
+      break;
+    }
+    e->used = 0;
+  }
+  memcpy(key,k->mv_data,k->mv_size);
+  e->key = key;
+  e->klen = k->mv_size;
+  e->dbi = dbi;
+  e->hash = h;
+  e->snap = snap;
+  e->used = 0;
+  lua_pushvalue(L,-1);
+  e->ref = luaL_ref(L,LUA_REGISTRYINDEX);
+  e->next = c->buckets[h%c->nbuckets];
+  c->buckets[h%c->nbuckets] = i;
+  ++c->size;
+}
+
+/*
+ * a cached value read from snapshot s is valid for a txn reading snapshot
+ * snap as long as the dbi wasn't written to after either of them.
+ */
+static int cache_get(lua_State* L,txn_ud* t,MDB_dbi dbi,MDB_val* k) {
+  hot_cache* c = t->cache;
+  size_t snap = mdb_txn_id(t->txn);
+  size_t written = env_ctx_written(t->ctx,dbi,snap);
+  unsigned int h = cache_hash(dbi,k);
+  int i = cache_find(c,dbi,h,k);
+  MDB_val v;
+  int err;
+
+  if ( i>=0 ) {
+    cache_entry* e = &c->entries[i];
+    if ( written<=e->snap && written<=snap ) {
+      ++c->hits;
+      e->used = 1;
+      lua_rawgeti(L,LUA_REGISTRYINDEX,e->ref);
+      return 1;
+    }
+    if ( written<=snap ) {
+      cache_drop(L,c,i);
+      ++c->invalidations;
+    }
+  }
+
+  ++c->misses;
+  err = mdb_get(t->txn,dbi,k,&v);
+  switch (err) {
+  case MDB_NOTFOUND:
+    lua_pushnil(L);
+    return 1;
+  case 0:
+    lua_pushlstring(L,v.mv_data,v.mv_size);
+    if ( written<=snap ) {
+      cache_insert(L,c,dbi,h,k,snap);
+    }
+    return 1;
+  }
+  return error_and_out(L,err);
+}
+
+/* env */
+static int env_open(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  const char* path = luaL_checkstring(L,2);
+  mode_t flags = (mode_t)luaL_checkinteger(L,3);
+  int mode = luaL_checkinteger(L,4);
+  int err;
+
+  if ( !path ) {
+    return str_error_and_out(L,"path required");
+  }
+  err = mdb_env_open(env,path,flags,mode);
+  return success_or_err(L,err);
+}
+
+static int env_copy(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  const char* path = luaL_checkstring(L,2);
+  int err;
+
+  if ( !path ) {
+    return str_error_and_out(L,"path required");
+  }
+  err = mdb_env_copy(env,path);
+  return success_or_err(L,err);
+}
+
+/*
+ * the compacted copy is written next to path and renamed over it once it is
+ * complete, so path is either the previous file or a complete copy.
+ */
+static int env_compact_to(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  const char* path = luaL_checkstring(L,2);
+  const char* tmp;
+  int fd;
+  int err;
+
+  lua_pushfstring(L,"%s.tmp",path);
+  tmp = lua_tostring(L,-1);
+  fd = open(tmp,O_WRONLY|O_CREAT|O_TRUNC,0644);
+  if ( fd<0 ) {
+    return error_and_out(L,errno);
+  }
+  err = mdb_env_copyfd2(env,fd,MDB_CP_COMPACT);
+  if ( !err && fsync(fd) ) {
+    err = errno;
+  }
+  if ( close(fd) && !err ) {
+    err = errno;
+  }
+  if ( !err && rename(tmp,path) ) {
+    err = errno;
+  }
+  if ( err ) {
+    unlink(tmp);
+  }
+  lua_pop(L,1);
+  return success_or_err(L,err);
+}
+
+static size_t stat_pages(MDB_stat* stat) {
+  return stat->ms_branch_pages+stat->ms_leaf_pages+stat->ms_overflow_pages;
+}
+
+/*
+ * the named dbis are the keys of the main dbi whose values are MDB_db records
+ * (the unexported struct of two 32 bit fields and five page numbers). Other
+ * keys are skipped, as are the ones failing to open with MDB_INCOMPATIBLE, and
+ * any other failure fails the report. A main dbi which is MDB_DUPSORT or
+ * MDB_INTEGERKEY can't hold named dbis at all.
+ */
+#define MDB_DB_SIZE (8+5*sizeof(size_t))
+
+static int space_report_dbs(lua_State *L,MDB_txn* txn,size_t* pages) {
+  MDB_cursor* cursor;
+  MDB_val k,v;
+  MDB_dbi dbi;
+  MDB_stat stat;
+  unsigned int flags;
+  const char* name;
+  int err;
+
+  *pages = 0;
+  lua_newtable(L);
+  err = mdb_dbi_flags(txn,MAIN_DBI,&flags);
+  if ( err || (flags & (MDB_DUPSORT|MDB_INTEGERKEY)) ) {
+    return err;
+  }
+  err = mdb_cursor_open(txn,MAIN_DBI,&cursor);
+  if ( err ) {
+    return err;
+  }
+  while ( (err = mdb_cursor_get(cursor,&k,&v,MDB_NEXT))==0 ) {
+    if ( v.mv_size!=MDB_DB_SIZE || memchr(k.mv_data,0,k.mv_size) ) {
+      continue;
+    }
+    name = lua_pushlstring(L,k.mv_data,k.mv_size);
+    err = mdb_dbi_open(txn,name,0,&dbi);
+    if ( err==MDB_INCOMPATIBLE ) {
+      lua_pop(L,1);
+      continue;
+    }
+    if ( !err ) {
+      err = mdb_stat(txn,dbi,&stat);
+    }
+    if ( err ) {
+      /* not to be mistaken for the end of the walk */
+      err = err==MDB_NOTFOUND ? MDB_CORRUPTED : err;
+      break;
+    }
+    *pages += stat_pages(&stat);
+    lua_pushinteger(L,stat_pages(&stat));
+    lua_rawset(L,-3);
+  }
+  mdb_cursor_close(cursor);
+  return err==MDB_NOTFOUND ? 0 : err;
+}
+
+static int env_space_report(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  MDB_envinfo info;
+  MDB_stat stat;
+  MDB_txn* txn;
+  MDB_cursor* cursor;
+  MDB_val k,v;
+  size_t free_pages = 0;
+  size_t freelist_pages,main_pages,dbs_pages,used_pages;
+  int err = mdb_txn_begin(env,NULL,MDB_RDONLY,&txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+
+  /* every freelist record is a list of page numbers, prefixed by its length */
+  err = mdb_cursor_open(txn,FREE_DBI,&cursor);
+  if ( err ) {
+    mdb_txn_abort(txn);
+    return error_and_out(L,err);
+  }
+  while ( err==0 ) {
+    err = mdb_cursor_get(cursor,&k,&v,MDB_NEXT);
+    if ( err==0 && v.mv_size>=sizeof(size_t) ) {
+      size_t n;
+      memcpy(&n,v.mv_data,sizeof(n));
+      free_pages += n;
+    }
+  }
+  mdb_cursor_close(cursor);
+  if ( err!=MDB_NOTFOUND ) {
+    mdb_txn_abort(txn);
+    return error_and_out(L,err);
+  }
+
+  mdb_env_info(env,&info);
+  mdb_stat(txn,FREE_DBI,&stat);
+  freelist_pages = stat_pages(&stat);
+  mdb_stat(txn,MAIN_DBI,&stat);
+  main_pages = stat_pages(&stat);
+  used_pages = info.me_last_pgno+1;
+
+  lua_newtable(L);
+  lua_pushinteger(L,stat.ms_psize);
+  lua_setfield(L,-2,"page_size");
+  lua_pushinteger(L,info.me_mapsize/stat.ms_psize);
+  lua_setfield(L,-2,"map_pages");
+  lua_pushinteger(L,used_pages);
+  lua_setfield(L,-2,"used_pages");
+  lua_pushinteger(L,free_pages);
+  lua_setfield(L,-2,"free_pages");
+  lua_pushinteger(L,freelist_pages);
+  lua_setfield(L,-2,"freelist_pages");
+  lua_pushinteger(L,main_pages);
+  lua_setfield(L,-2,"main_pages");
+  err = space_report_dbs(L,txn,&dbs_pages);
+  if ( err ) {
+    mdb_txn_abort(txn);
+    return error_and_out(L,err);
+  }
+  lua_setfield(L,-2,"dbs");
+  lua_pushinteger(L,main_pages+dbs_pages);
+  lua_setfield(L,-2,"live_pages");
+  lua_pushnumber(L,used_pages ? (lua_Number)free_pages/used_pages : 0);
+  lua_setfield(L,-2,"fragmentation");
+  mdb_txn_abort(txn);
+  return 1;
+}
+
+static int env_stat(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  MDB_stat stat;
+  mdb_env_stat(env,&stat);
+  return stat_to_table(L,&stat);
+}
+
+static int env_info(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  MDB_envinfo info;
+  mdb_env_info(env,&info);
+  lua_newtable(L);
+
+  lua_pushinteger(L,info.me_mapsize);
+  lua_setfield(L,-2,"me_mapsize");
+  lua_pushinteger(L,info.me_last_pgno);
+  lua_setfield(L,-2,"me_last_pgno");
+  lua_pushinteger(L,info.me_last_txnid);
+  lua_setfield(L,-2,"me_last_txnid");
+  lua_pushinteger(L,info.me_maxreaders);
+  lua_setfield(L,-2,"me_maxreaders");
+  lua_pushinteger(L,info.me_numreaders);
+  lua_setfield(L,-2,"me_numreaders");
+  return 1;
+
+}
+
+static int env_sync(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  int force = luaL_checkinteger(L,2);
+  int err = mdb_env_sync(env,force);
+  return success_or_err(L,err);
+}
+
+/*
+ * process wide registry of envs opened through lightningmdb.env_shared, so
+ * that Lua states running on different threads share a single MDB_env.
+ */
+static pthread_mutex_t shared_envs_lock = PTHREAD_MUTEX_INITIALIZER;
+static env_ctx* shared_envs = NULL;
+
+static int shared_env_release(env_ctx* ctx) {
+  env_ctx** p;
+  int last;
+  pthread_mutex_lock(&shared_envs_lock);
+  last = (--ctx->refs==0);
+  if ( last ) {
+    for (p=&shared_envs; *p; p=&(*p)->next) {
+      if ( *p==ctx ) {
+        *p = ctx->next;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&shared_envs_lock);
+  return last;
+}
+
+static int env_close(lua_State *L) {
+  env_ud* e = check_env_ud(L,1);
+  env_ctx* ctx = get_env_ctx(e->env,0);
+  cache_free(L,e->cache);
+  e->cache = NULL;
+  if ( !ctx || !ctx->refs || shared_env_release(ctx) ) {
+    env_ctx_free(ctx);
+    mdb_env_close(e->env);
+  }
+  clean_metatable(L);
+  return 0;
+}
+
+static int env_set_flags(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  unsigned int flags = luaL_checkinteger(L,2);
+  int onoff = luaL_checkinteger(L,3);
+  int err = mdb_env_set_flags(env,flags,onoff);
+  return success_or_err(L,err);
+}
+
+static int env_get_flags(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  unsigned int flags = 0;
+  int err = mdb_env_get_flags(env,&flags);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  lua_pushinteger(L,flags);
+  return 1;
+}
+
+static int env_get_path(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  const char* path;
+  int err = mdb_env_get_path(env,&path);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  lua_pushstring(L,path);
+  return 1;
+}
+
+static int env_set_mapsize(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  size_t size = luaL_checkinteger(L,2);
+  int err = mdb_env_set_mapsize(env,size);
+  return success_or_err(L,err);
+}
+
+static int env_set_maxreaders(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  unsigned int readers = luaL_checkinteger(L,2);
+  int err = mdb_env_set_maxreaders(env,readers);
+  return success_or_err(L,err);
+}
+
+static int env_get_maxreaders(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  unsigned int readers = 0;
+  int err = mdb_env_get_maxreaders(env,&readers);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  lua_pushinteger(L,readers);
+  return 1;
+}
+
+static int env_set_maxdbs(lua_State *L) {
+  MDB_env* env = check_env(L,1);
+  int num = luaL_checkinteger(L,2);
+  int err = mdb_env_set_maxdbs(env,num);
+  return success_or_err(L,err);
+}
+
+static int env_txn_begin(lua_State* L) {
+  env_ud* e = check_env_ud(L,1);
+  txn_ud* parent = lua_isnil(L,2) ? NULL : check_txn_ud(L,2);
+  unsigned int flags = luaL_checkinteger(L,3);
+  unsigned int env_flags = 0;
+  int err;
+  MDB_txn* txn;
+  txn_ud* t;
+  if ( !e->env ) {
+    return str_error_and_out(L,"bad params");
+  }
+
+  err = mdb_txn_begin(e->env,parent ? parent->txn : NULL,flags,&txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  mdb_env_get_flags(e->env,&env_flags);
+  t = push_txn(L,txn,parent ? 2 : 0);
+  t->depth = parent ? parent->depth+1 : 0;
+  t->rdonly = ((flags|env_flags) & MDB_RDONLY)!=0;
+  if ( t->rdonly && t->ctx && e->cache ) {
+    t->cache = e->cache;
+    ++t->cache->refs;
+  }
+  return 1;
+}
+
+/*
+ * the MDB_ handles, for lightningmdb.ffi. They are refused while features of
+ * lightningmdb which the FFI calls would bypass are enabled, and once given
+ * out, as the FFI objects can't be tracked, the features can't be enabled for
+ * the rest of the env's life.
+ */
+#define WRAPPED_ERROR "handles of the env were wrapped by lightningmdb.ffi"
+
+static int push_handle(lua_State* L,void* handle,MDB_env* env,
+                       hot_cache* cache) {
+  env_ctx* ctx = get_env_ctx(env,1);
+  const char* feature = NULL;
+  if ( !ctx ) {
+    return error_and_out(L,ENOMEM);
+  }
+  pthread_mutex_lock(&ctx->lock);
+  if ( ctx->capture ) {
+    feature = "change capture";
+  } else if ( ctx->ttl ) {
+    feature = "key expiry";
+  } else if ( cache ) {
+    feature = "the hot key cache";
+  } else {
+    ctx->wrapped = 1;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+  if ( feature ) {
+    lua_pushnil(L);
+    lua_pushfstring(L,"%s is enabled, which FFI calls would bypass",feature);
+    return 2;
+  }
+  lua_pushlightuserdata(L,handle);
+  return 1;
+}
+
+static int env_wrapped(env_ctx* ctx) {
+  int wrapped;
+  pthread_mutex_lock(&ctx->lock);
+  wrapped = ctx->wrapped;
+  pthread_mutex_unlock(&ctx->lock);
+  return wrapped;
+}
+
+static int env_handle(lua_State* L) {
+  env_ud* e = check_env_ud(L,1);
+  return push_handle(L,e->env,e->env,e->cache);
+}
+
+static int env_dbi_close(lua_State* L) {
+  MDB_env* env = check_env(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  env_ctx* ctx = get_env_ctx(env,0);
+
+  if ( ctx ) {
+    env_ctx_set_name(ctx,dbi,NULL);
+  }
+  mdb_dbi_close(env,dbi);
+  return 0;
+}
+
+static int env_cache_enable(lua_State* L) {
+  env_ud* e = check_env_ud(L,1);
+  int capacity = luaL_checkinteger(L,2);
+  env_ctx* ctx = get_env_ctx(e->env,1);
+  luaL_argcheck(L,capacity>0,2,"capacity must be positive");
+  if ( !ctx ) {
+    return error_and_out(L,ENOMEM);
+  }
+  if ( env_wrapped(ctx) ) {
+    return str_error_and_out(L,WRAPPED_ERROR);
+  }
+  cache_free(L,e->cache);
+  e->cache = cache_new(capacity);
+  return success_or_err(L,e->cache ? 0 : ENOMEM);
+}
+
+static int env_cache_disable(lua_State* L) {
+  env_ud* e = check_env_ud(L,1);
+  cache_free(L,e->cache);
+  e->cache = NULL;
+  return success_or_err(L,0);
+}
+
+static int env_cache_stats(lua_State* L) {
+  env_ud* e = check_env_ud(L,1);
+  hot_cache* c = e->cache;
+  if ( !c ) {
+    return str_error_and_out(L,"cache is not enabled");
+  }
+  lua_newtable(L);
+  lua_pushinteger(L,c->capacity);
+  lua_setfield(L,-2,"capacity");
+  lua_pushinteger(L,c->size);
+  lua_setfield(L,-2,"size");
+  lua_pushinteger(L,c->hits);
+  lua_setfield(L,-2,"hits");
+  lua_pushinteger(L,c->misses);
+  lua_setfield(L,-2,"misses");
+  lua_pushinteger(L,c->evictions);
+  lua_setfield(L,-2,"evictions");
+  lua_pushinteger(L,c->invalidations);
+  lua_setfield(L,-2,"invalidations");
+  return 1;
+}
+
+static int env_changes_enable(lua_State* L) {
+  MDB_env* env = check_env(L,1);
+  const char* name = luaL_optstring(L,2,CHANGES_DBI_NAME);
+  env_ctx* ctx = get_env_ctx(env,1);
+  MDB_txn* txn;
+  MDB_dbi dbi;
+  int err;
+  if ( !ctx ) {
+    return error_and_out(L,ENOMEM);
+  }
+  if ( env_wrapped(ctx) ) {
+    return str_error_and_out(L,WRAPPED_ERROR);
+  }
+
+  err = mdb_txn_begin(env,NULL,0,&txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  err = mdb_dbi_open(txn,name,MDB_CREATE,&dbi);
+  if ( err ) {
+    mdb_txn_abort(txn);
+    return error_and_out(L,err);
+  }
+  err = mdb_txn_commit(txn);
+  if ( !err ) {
+    ctx->changes_dbi = dbi;
+    ctx->capture = 1;
+  }
+  return success_or_err(L,err);
+}
+
+static int env_changes_disable(lua_State* L) {
+  MDB_env* env = check_env(L,1);
+  env_ctx* ctx = get_env_ctx(env,0);
+  if ( ctx ) {
+    ctx->capture = 0;
+  }
+  return success_or_err(L,0);
+}
+
+static int changes_iter(lua_State* L) {
+  MDB_env* env = check_env(L,lua_upvalueindex(1));
+  env_ctx* ctx = get_env_ctx(env,0);
+  size_t from = (size_t)lua_tointeger(L,lua_upvalueindex(2));
+  unsigned char seq[8];
+  MDB_txn* txn;
+  MDB_cursor* cursor;
+  MDB_val k,v;
+  int err;
+
+  if ( !ctx || !ctx->changes_dbi ) {
+    return str_error_and_out(L,"change capture is not enabled");
+  }
+  err = mdb_txn_begin(env,NULL,MDB_RDONLY,&txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  err = mdb_cursor_open(txn,ctx->changes_dbi,&cursor);
+  if ( err ) {
+    mdb_txn_abort(txn);
+    return error_and_out(L,err);
+  }
+  put_u64(seq,from);
+  k.mv_data = seq;
+  k.mv_size = 8;
+  err = mdb_cursor_get(cursor,&k,&v,MDB_SET_RANGE);
+  if ( err==0 && (k.mv_size!=8 || v.mv_size<8) ) {
+    err = MDB_CORRUPTED;
+  }
+  if ( err==0 ) {
+    from = get_u64(k.mv_data);
+    lua_pushinteger(L,from);
+    lua_pushinteger(L,get_u64(v.mv_data));
+    if ( changes_to_table(L,(const unsigned char*)v.mv_data+8,v.mv_size-8) ) {
+      lua_settop(L,0);
+      err = MDB_CORRUPTED;
+    }
+  }
+  mdb_cursor_close(cursor);
+  mdb_txn_abort(txn);
+
+  switch (err) {
+  case MDB_NOTFOUND:
+    lua_pushnil(L);
+    return 1;
+  case 0:
+    lua_pushinteger(L,from+1);
+    lua_replace(L,lua_upvalueindex(2));
+    return 3;
+  }
+  return error_and_out(L,err);
+}
+
+static int env_changes_since(lua_State* L) {
+  check_env(L,1);
+  luaL_checkinteger(L,2);
+  lua_settop(L,2);
+  lua_pushcclosure(L,changes_iter,2);
+  return 1;
+}
+
+static int env_changes_trim(lua_State* L) {
+  MDB_env* env = check_env(L,1);
+  size_t upto = (size_t)luaL_checkinteger(L,2);
+  env_ctx* ctx = get_env_ctx(env,0);
+  MDB_txn* txn;
+  MDB_cursor* cursor;
+  MDB_val k,v;
+  size_t count = 0;
+  int err;
+
+  if ( !ctx || !ctx->changes_dbi ) {
+    return str_error_and_out(L,"change capture is not enabled");
+  }
+  err = mdb_txn_begin(env,NULL,0,&txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  err = mdb_cursor_open(txn,ctx->changes_dbi,&cursor);
+  while ( err==0 ) {
+    err = mdb_cursor_get(cursor,&k,&v,MDB_FIRST);
+    if ( err || k.mv_size!=8 || get_u64(k.mv_data)>=upto ) {
+      break;
+    }
+    err = mdb_cursor_del(cursor,0);
+    ++count;
+  }
+  if ( err==0 || err==MDB_NOTFOUND ) {
+    mdb_cursor_close(cursor);
+    err = mdb_txn_commit(txn);
+  } else {
+    mdb_txn_abort(txn);
+  }
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  lua_pushinteger(L,count);
+  return 1;
+}
+
+
+static int env_ttl_enable(lua_State* L) {
+  MDB_env* env = check_env(L,1);
+  env_ctx* ctx = get_env_ctx(env,1);
+  MDB_txn* txn;
+  MDB_dbi dbi,keys_dbi;
+  int err;
+  if ( !ctx ) {
+    return error_and_out(L,ENOMEM);
+  }
+  if ( env_wrapped(ctx) ) {
+    return str_error_and_out(L,WRAPPED_ERROR);
+  }
+
+  err = mdb_txn_begin(env,NULL,0,&txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  err = mdb_dbi_open(txn,TTL_DBI_NAME,MDB_CREATE,&dbi);
+  if ( !err ) {
+    err = mdb_dbi_open(txn,TTL_KEYS_DBI_NAME,MDB_CREATE,&keys_dbi);
+  }
+  if ( err ) {
+    mdb_txn_abort(txn);
+    return error_and_out(L,err);
+  }
+  err = mdb_txn_commit(txn);
+  if ( !err ) {
+    pthread_mutex_lock(&ctx->lock);
+    ctx->ttl_dbi = dbi;
+    ctx->ttl_keys_dbi = keys_dbi;
+    ctx->ttl = 1;
+    pthread_mutex_unlock(&ctx->lock);
+  }
+  return success_or_err(L,err);
+}
+
+/*
+ * env:expire([max_ops]) deletes up to max_ops (default unlimited) keys whose
+ * time is due, walking the expiry dbi from its oldest entry. Returns the number
+ * of keys deleted.
+ */
+static int env_expire(lua_State* L) {
+  MDB_env* env = check_env(L,1);
+  size_t max_ops = (size_t)luaL_optinteger(L,2,0);
+  uint64_t now = (uint64_t)time(NULL);
+  char buf[TTL_KEY_MAX];
+  MDB_cursor* cursor;
+  MDB_val k,v,ik,fk;
+  MDB_dbi dbi;
+  size_t count = 0;
+  size_t name_len;
+  txn_ud t;
+  int err;
+
+  memset(&t,0,sizeof(t));
+  t.ctx = get_env_ctx(env,0);
+  if ( !t.ctx || !t.ctx->ttl ) {
+    return str_error_and_out(L,"key expiry is not enabled");
+  }
+  err = mdb_txn_begin(env,NULL,0,&t.txn);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  err = mdb_cursor_open(t.txn,t.ctx->ttl_dbi,&cursor);
+  if ( err ) {
+    mdb_txn_abort(t.txn);
+    return error_and_out(L,err);
+  }
+
+  while ( !max_ops || count<max_ops ) {
+    err = mdb_cursor_get(cursor,&ik,&v,MDB_FIRST);
+    if ( err || ik.mv_size<9 || get_u64(ik.mv_data)>now ) {
+      break;
+    }
+    /* copied as the deletes below may reuse the page it lives in */
+    if ( ik.mv_size>sizeof(buf) ||
+         !memchr((char*)ik.mv_data+8,0,ik.mv_size-8) ) {
+      err = MDB_CORRUPTED;
+      break;
+    }
+    memcpy(buf,ik.mv_data,ik.mv_size);
+    ik.mv_data = buf;
+    fk.mv_data = buf+8;
+    fk.mv_size = ik.mv_size-8;
+    name_len = strlen(buf+8);
+    k.mv_data = buf+8+name_len+1;
+    k.mv_size = fk.mv_size-name_len-1;
+
+    /* the dbi may have been dropped since */
+    err = mdb_dbi_open(t.txn,name_len ? buf+8 : NULL,0,&dbi);
+    if ( !err ) {
+      txn_touch(&t,dbi);
+      err = mdb_del(t.txn,dbi,&k,NULL);
+      if ( !err ) {
+        err = txn_record(&t,'d',dbi,&k,NULL);
+      }
+    }
+    if ( err==0 || err==MDB_NOTFOUND ) {
+      txn_touch(&t,t.ctx->ttl_keys_dbi);
+      err = mdb_del(t.txn,t.ctx->ttl_keys_dbi,&fk,NULL);
+    }
+    if ( err==0 || err==MDB_NOTFOUND ) {
+      txn_touch(&t,t.ctx->ttl_dbi);
+      err = mdb_del(t.txn,t.ctx->ttl_dbi,&ik,NULL);
+    }
+    if ( err ) {
+      break;
+    }
+    ++count;
+  }
+  mdb_cursor_close(cursor);
+
+  if ( err && err!=MDB_NOTFOUND ) {
+    mdb_txn_abort(t.txn);
+    txn_ud_release(&t);
+    return error_and_out(L,err);
+  }
+  err = txn_commit_ud(&t);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  lua_pushinteger(L,count);
+  return 1;
+}
+
+static const luaL_Reg env_methods[] = {
+#if LUA_VERSION_NUM >= 504
+  {"__close",env_close},
+#endif
+  {"__gc",env_close},
+  {"open",env_open},
+  {"copy",env_copy},
+  {"compact_to",env_compact_to},
+  {"space_report",env_space_report},
+  {"stat",env_stat},
+  {"info",env_info},
+  {"sync",env_sync},
+  {"close",env_close},
+  {"set_flags",env_set_flags},
+  {"get_flags",env_get_flags},
+  {"get_path",env_get_path},
+  {"set_mapsize",env_set_mapsize},
+  {"set_maxreaders",env_set_maxreaders},
+  {"get_maxreaders",env_get_maxreaders},
+  {"set_maxdbs",env_set_maxdbs},
+  {"txn_begin",env_txn_begin},
+  {"dbi_close",env_dbi_close},
+  {"handle",env_handle},
+  {"cache_enable",env_cache_enable},
+  {"cache_disable",env_cache_disable},
+  {"cache_stats",env_cache_stats},
+  {"changes_enable",env_changes_enable},
+  {"changes_disable",env_changes_disable},
+  {"changes_since",env_changes_since},
+  {"changes_trim",env_changes_trim},
+  {"ttl_enable",env_ttl_enable},
+  {"expire",env_expire},
+  {0,0}
+};
+
+
+DEFINE_register_methods(env,ENV)
+
+/* cursor */
+static int cursor_close(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  mdb_cursor_close(c->cursor);
+  unanchor(L,&c->txn_ref);
+  clean_metatable(L);
+  return 0;
+}
+
+static int cursor_txn(lua_State *L) {
+  MDB_cursor* cursor = check_cursor(L,1);
+  MDB_txn* txn = mdb_cursor_txn(cursor);
+  (void)txn;
+  /* TODO - we'll need a mapping from MDB_txn* to the lua userdata */
+  return unimplemented(L);
+}
+
+static int cursor_handle(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  if ( !c->txn->txn ) {
+    return str_error_and_out(L,"the cursor's txn has ended");
+  }
+  return push_handle(L,c->cursor,mdb_txn_env(c->txn->txn),c->txn->cache);
+}
+
+static int cursor_dbi(lua_State *L) {
+  MDB_cursor* cursor = check_cursor(L,1);
+  MDB_dbi dbi = mdb_cursor_dbi(cursor);
+  lua_pushinteger(L,dbi);
+  return 1;
+}
+
+/*
+ * envs opened with MDB_NORDAHEAD fault the pages of a cold scan one at a time.
+ * Scanning cursors ask the kernel to read the pages ahead of the record they
+ * stand on, in the direction of the scan, whenever it nears the end of the
+ * previously advised window. This pays off as long as the scanned dbi is laid
+ * out more or less sequentially, e.g. when it was bulk loaded in key order.
+ */
+static void cursor_advise(cursor_ud* c,MDB_cursor_op op,MDB_val* v) {
+#ifdef MADV_WILLNEED
+  static uintptr_t page_size = 0;
+  int backward = (op==MDB_PREV || op==MDB_PREV_DUP || op==MDB_PREV_NODUP ||
+                  op==MDB_LAST || op==MDB_LAST_DUP);
+  char* p = (char*)v->mv_data;
+  char* map;
+  char* from;
+  char* to;
+  MDB_envinfo info;
+
+  if ( backward ? (p>=c->advised_from+c->readahead/2 && p<c->advised_to)
+       : (p>=c->advised_from && p+v->mv_size+c->readahead/2<=c->advised_to) ) {
+    return;
+  }
+  if ( !page_size ) {
+    page_size = sysconf(_SC_PAGESIZE);
+  }
+  mdb_env_info(mdb_txn_env(mdb_cursor_txn(c->cursor)),&info);
+  map = (char*)info.me_mapaddr;
+  if ( p<map || p>=map+info.me_mapsize ) {
+    return; /* a dirty page of a write txn */
+  }
+  from = backward ? p-c->readahead : p;
+  to = backward ? p+v->mv_size : p+v->mv_size+c->readahead;
+  if ( backward && (size_t)(p-map)<c->readahead ) {
+    from = map;
+  }
+  if ( to>map+info.me_mapsize ) {
+    to = map+info.me_mapsize;
+  }
+  from = (char*)((uintptr_t)from & ~(page_size-1));
+  madvise(from,to-from,MADV_WILLNEED);
+  c->advised_from = from;
+  c->advised_to = to;
+#endif
+}
+
+static int cursor_get(lua_State *L) {
+  int with_value = (lua_gettop(L) > 3);
+  cursor_ud* c = check_cursor_ud(L,1);
+  MDB_cursor* cursor = c->cursor;
+  MDB_val k,v;
+  MDB_cursor_op op = luaL_checkinteger(L,with_value?4:3);
+  int err;
+  pop_val(L,2,&k);
+  if (with_value) pop_val(L,3,&v);
+  err = mdb_cursor_get(cursor,&k,&v,op);
+  switch (err) {
+  case MDB_NOTFOUND:
+    lua_pushnil(L);
+    return 1;
+  case 0:
+    if ( c->readahead ) {
+      cursor_advise(c,op,&v);
+    }
+    lua_pushlstring(L,k.mv_data,k.mv_size);
+    lua_pushlstring(L,v.mv_data,v.mv_size);
+    return 2;
+  }
+  return error_and_out(L,err);
+}
+
+static int cursor_get_key(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  MDB_cursor* cursor = c->cursor;
+  MDB_val k;
+  MDB_cursor_op op = luaL_checkinteger(L,3);
+  int err;
+  pop_val(L,2,&k);
+  err = mdb_cursor_get(cursor,&k,NULL,op);
+  switch (err) {
+  case MDB_NOTFOUND:
+    lua_pushnil(L);
+    return 1;
+  case 0:
+    if ( c->readahead ) {
+      cursor_advise(c,op,&k);
+    }
+    lua_pushlstring(L,k.mv_data,k.mv_size);
+    return 1;
+  }
+  return error_and_out(L,err);
+}
+
+static int cursor_put(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  MDB_val k,v;
+  unsigned int flags = luaL_checkinteger(L,4);
+  int err;
+  pop_val(L,2,&k);
+  pop_val(L,3,&v);
+  txn_touch(c->txn,mdb_cursor_dbi(c->cursor));
+  err = mdb_cursor_put(c->cursor,&k,&v,flags);
+  if ( !err ) {
+    err = txn_record(c->txn,'p',mdb_cursor_dbi(c->cursor),&k,&v);
+  }
+  if ( !err ) {
+    err = ttl_forget(c->txn,mdb_cursor_dbi(c->cursor),&k);
+  }
+  return success_or_err(L,err);
+}
+
+static int cursor_del(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  unsigned int flags = luaL_checkinteger(L,2);
+  MDB_dbi dbi = mdb_cursor_dbi(c->cursor);
+  int ttl = ttl_active(c->txn,dbi);
+  char key[TTL_KEY_MAX];
+  MDB_val k,v;
+  int err = 0;
+  txn_touch(c->txn,dbi);
+  if ( ttl || (c->txn->ctx && c->txn->ctx->capture) ) {
+    err = mdb_cursor_get(c->cursor,&k,&v,MDB_GET_CURRENT);
+    if ( !err ) {
+      err = txn_record(c->txn,'d',dbi,&k,(flags & MDB_NODUPDATA) ? NULL : &v);
+    }
+    /* the key lives in a page the delete may reuse */
+    if ( !err && ttl && k.mv_size<=sizeof(key) ) {
+      memcpy(key,k.mv_data,k.mv_size);
+      k.mv_data = key;
+    } else {
+      ttl = 0;
+    }
+  }
+  if ( !err ) {
+    err = mdb_cursor_del(c->cursor,flags);
+  }
+  if ( !err && ttl ) {
+    err = ttl_forget_if_gone(c->txn,dbi,&k);
+  }
+  return success_or_err(L,err);
+}
+
+static int cursor_readahead(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  lua_Integer bytes = luaL_optinteger(L,2,0);
+  luaL_argcheck(L,bytes>=0,2,"must not be negative");
+  c->readahead = bytes;
+  c->advised_from = c->advised_to = NULL;
+  return success_or_err(L,0);
+}
+
+static int cursor_count(lua_State *L) {
+  MDB_cursor* cursor = check_cursor(L,1);
+  size_t count = 0;
+  int err = mdb_cursor_count(cursor,&count);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  lua_pushinteger(L,count);
+  return 1;
+}
+
+/*
+ * columns are packed strings of native doubles, read out of fixed width
+ * records described using the codes of lpack.
+ */
+typedef struct {
+  int code;
+  int swap;
+  size_t offset;
+  size_t size;
+  size_t record;      /* size of the whole record */
+} column_field;
+
+/* returns an error message or NULL */
+static const char* column_parse(const char* f,int field,column_field* c) {
+  size_t offset = 0;
+  size_t size;
+  int swap = 0;
+  int n = 0;
+  memset(c,0,sizeof(column_field));
+  while ( *f ) {
+    int code = *f++;
+    int N = 1;
+    if ( isdigit((unsigned char)*f) ) {
+      N = 0;
+      while ( isdigit((unsigned char)*f) ) N = 10*N+(*f++)-'0';
+    }
+    switch (code) {
+    case OP_LITTLEENDIAN:
+    case OP_BIGENDIAN:
+    case OP_NATIVE:
+      swap = doendian(code);
+      continue;
+    case ' ': case ',':
+      continue;
+    case OP_STRING:
+      /* N bytes which aren't numbers, counted as a single field */
+      size = N;
+      N = 1;
+      break;
+    case OP_DOUBLE: size = sizeof(double); break;
+    case OP_NUMBER: size = sizeof(lua_Number); break;
+    case OP_FLOAT: size = sizeof(float); break;
+    case OP_CHAR: size = sizeof(char); break;
+    case OP_BYTE: size = sizeof(unsigned char); break;
+    case OP_SHORT: size = sizeof(short); break;
+    case OP_USHORT: size = sizeof(unsigned short); break;
+    case OP_INT: size = sizeof(int); break;
+    case OP_UINT: size = sizeof(unsigned int); break;
+    case OP_LONG: size = sizeof(long); break;
+    case OP_ULONG: size = sizeof(unsigned long); break;
+    default:
+      return "bad code in record format";
+    }
+    while ( N-- ) {
+      if ( ++n==field ) {
+        c->code = code;
+        c->swap = swap;
+        c->offset = offset;
+        c->size = size;
+      }
+      offset += size;
+    }
+  }
+  c->record = offset;
+  if ( !c->size ) {
+    return "no such field in record format";
+  }
+  return c->code==OP_STRING ? "field is not a number" : NULL;
+}
+
+static double column_value(const column_field* c,const char* record) {
+  union {
+    double d; lua_Number n; float f; char c; unsigned char b;
+    short h; unsigned short H; int i; unsigned int I; long l; unsigned long L;
+  } u;
+  memcpy(&u,record+c->offset,c->size);
+  doswap(c->swap,&u,c->size);
+  switch (c->code) {
+  case OP_DOUBLE: return u.d;
+  case OP_NUMBER: return (double)u.n;
+  case OP_FLOAT: return u.f;
+  case OP_CHAR: return u.c;
+  case OP_BYTE: return u.b;
+  case OP_SHORT: return u.h;
+  case OP_USHORT: return u.H;
+  case OP_INT: return u.i;
+  case OP_UINT: return u.I;
+  case OP_LONG: return (double)u.l;
+  case OP_ULONG: return (double)u.L;
+  }
+  return 0;
+}
+
+/*
+ * cursor:read_column(rows,format,field) reads up to rows records following the
+ * cursor's position and returns the given field of each of them as a column,
+ * along with the number of records read.
+ */
+static int cursor_read_column(lua_State *L) {
+  cursor_ud* c = check_cursor_ud(L,1);
+  lua_Integer rows = luaL_checkinteger(L,2);
+  const char* format = luaL_checkstring(L,3);
+  int field = (int)luaL_checkinteger(L,4);
+  column_field col;
+  const char* msg = column_parse(format,field,&col);
+  double* out = NULL;
+  size_t cap = 0;
+  size_t n = 0;
+  MDB_val k,v;
+  int err = 0;
+
+  luaL_argcheck(L,rows>=0,2,"must not be negative");
+  if ( msg ) {
+    return luaL_argerror(L,3,msg);
+  }
+  while ( n<(size_t)rows ) {
+    err = mdb_cursor_get(c->cursor,&k,&v,MDB_NEXT);
+    if ( err ) {
+      break;
+    }
+    if ( v.mv_size<col.record ) {
+      err = MDB_BAD_VALSIZE;
+      break;
+    }
+    if ( c->readahead ) {
+      cursor_advise(c,MDB_NEXT,&v);
+    }
+    if ( n==cap ) {
+      size_t grown = cap ? 2*cap : 1024;
+      double* p;
+      if ( grown>(size_t)rows ) {
+        grown = (size_t)rows;
+      }
+      p = (double*)realloc(out,grown*sizeof(double));
+      if ( !p ) {
+        err = ENOMEM;
+        break;
+      }
+      out = p;
+      cap = grown;
+    }
+    out[n++] = column_value(&col,(const char*)v.mv_data);
+  }
+  if ( err && err!=MDB_NOTFOUND ) {
+    free(out);
+    return error_and_out(L,err);
+  }
+
+  lua_pushlstring(L,out ? (const char*)out : "",n*sizeof(double));
+  free(out);
+  lua_pushinteger(L,n);
+  return 2;
+}
+
+static const luaL_Reg cursor_methods[] = {
+#if LUA_VERSION_NUM >= 504
+  {"__close",cursor_close},
+#endif
+  {"__gc",cursor_close},
+  {"close",cursor_close},
+  {"read_column",cursor_read_column},
+  {"txn",cursor_txn},
+  {"dbi",cursor_dbi},
+  {"get",cursor_get},
+  {"get_key",cursor_get_key},
+  {"put",cursor_put},
+  {"del",cursor_del},
+  {"count",cursor_count},
+  {"readahead",cursor_readahead},
+  {"handle",cursor_handle},
+
+  {0,0}
+};
+
+DEFINE_register_methods(cursor,CURSOR)
+
+/* txn */
+
+/*
+ * LMDB ends the nested txns of a txn along with it, so their userdata is left
+ * without a txn, failing any further use rather than touching freed memory.
+ */
+static void txn_ended(lua_State* L,txn_ud* t) {
+  txn_ud* d = t->child;
+  txn_ud* next;
+  while ( d ) {
+    next = d->child;
+    txn_ud_release(d);
+    d->txn = NULL;
+    d->child = NULL;
+    d = next;
+  }
+  if ( t->parent && t->parent->child==t ) {
+    t->parent->child = NULL;
+  }
+  t->txn = NULL;
+  t->child = NULL;
+  unanchor(L,&t->parent_ref);
+}
+
+static int txn_commit(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  int err = txn_commit_ud(t);
+  txn_ended(L,t);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+
+  clean_metatable(L);
+  lua_pushboolean(L,1);
+  return 1;
+}
+
+static int txn_abort(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  mdb_txn_abort(t->txn);
+  txn_ud_release(t);
+  txn_ended(L,t);
+  clean_metatable(L);
+  return 0;
+}
+
+/* a txn which was ended along with its parent is collected as well */
+static int txn_gc(lua_State* L) {
+  txn_ud* t = (txn_ud*)luaL_checkudata(L,1,TXN);
+  txn_ud_release(t);
+  txn_ended(L,t);
+  return clean_metatable(L);
+}
+
+static txn_ud* txn_begin_nested_ud(lua_State* L,int index,int* err) {
+  txn_ud* parent = check_txn_ud(L,index);
+  MDB_txn* txn;
+  txn_ud* t;
+  *err = mdb_txn_begin(mdb_txn_env(parent->txn),parent->txn,0,&txn);
+  if ( *err ) {
+    return NULL;
+  }
+  t = push_txn(L,txn,index);
+  t->depth = parent->depth+1;
+  return t;
+}
+
+static int txn_begin_nested(lua_State* L) {
+  int err;
+  if ( !txn_begin_nested_ud(L,1,&err) ) {
+    return error_and_out(L,err);
+  }
+  return 1;
+}
+
+/*
+ * committed and aborted txns lose their metatable, and the nested txns ending
+ * with them lose their txn
+ */
+static int txn_is_live(lua_State* L,int index) {
+  int live;
+  if ( !lua_getmetatable(L,index) ) {
+    return 0;
+  }
+  luaL_getmetatable(L,TXN);
+  live = lua_rawequal(L,-1,-2) && ((txn_ud*)lua_touserdata(L,index))->txn;
+  lua_pop(L,2);
+  return live;
+}
+
+static void txn_forget(lua_State* L,int index) {
+  txn_ended(L,(txn_ud*)lua_touserdata(L,index));
+  lua_pushvalue(L,index);
+  clean_metatable(L);
+  lua_pop(L,1);
+}
+
+/*
+ * txn:savepoint(fn,...) calls fn(child,...) in protected mode, with child
+ * being a txn nested in txn. Unless fn ends it, the child is committed when fn
+ * returns and aborted when it raises an error, so only its writes are undone.
+ */
+static int txn_savepoint(lua_State* L) {
+  int nargs = lua_gettop(L)-2;
+  txn_ud* t;
+  int child;
+  int i;
+  int err;
+
+  luaL_checktype(L,2,LUA_TFUNCTION);
+  t = txn_begin_nested_ud(L,1,&err);
+  if ( !t ) {
+    return error_and_out(L,err);
+  }
+  child = lua_gettop(L);
+  lua_pushvalue(L,2);
+  lua_pushvalue(L,child);
+  for (i=3; i<child; ++i) {
+    lua_pushvalue(L,i);
+  }
+
+  if ( lua_pcall(L,nargs+1,LUA_MULTRET,0) ) {
+    if ( txn_is_live(L,child) ) {
+      mdb_txn_abort(t->txn);
+      txn_ud_release(t);
+      txn_forget(L,child);
+    }
+    lua_pushnil(L);
+    lua_insert(L,-2);
+    return 2;
+  }
+
+  if ( txn_is_live(L,child) ) {
+    /* a failed commit frees the txn as well */
+    err = txn_commit_ud(t);
+    txn_forget(L,child);
+    if ( err ) {
+      return error_and_out(L,err);
+    }
+  }
+  lua_pushboolean(L,1);
+  lua_insert(L,child+1);
+  return lua_gettop(L)-child;
+}
+
+static int txn_depth(lua_State* L) {
+  lua_pushinteger(L,check_txn_ud(L,1)->depth);
+  return 1;
+}
+
+static int txn_reset(lua_State* L) {
+  MDB_txn* txn = check_txn(L,1);
+  mdb_txn_reset(txn);
+  return 0;
+}
+
+static int txn_renew(lua_State* L) {
+  MDB_txn* txn = check_txn(L,1);
+  mdb_txn_renew(txn);
+  return 0;
+}
+
+static int txn_dbi_open(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  const char* name = lua_isnil(L,2) ? NULL : luaL_checkstring(L,2);
+  unsigned int flags = luaL_checkinteger(L,3);
+  env_ctx* ctx;
+  MDB_dbi dbi;
+  int err;
+  if ( flags & MDB_CREATE ) {
+    txn_touch(t,MAIN_DBI);
+  }
+  err = mdb_dbi_open(t->txn,name,flags,&dbi);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  /* expiring keys and captured changes refer to their dbi by name */
+  ctx = get_env_ctx(mdb_txn_env(t->txn),1);
+  if ( ctx && name ) {
+    env_ctx_set_name(ctx,dbi,name);
+  }
+
+  lua_pushinteger(L,dbi);
+  return 1;
+}
+
+static int txn_stat(lua_State* L) {
+  MDB_txn* txn = check_txn(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_stat stat;
+  mdb_stat(txn,dbi,&stat);
+  return stat_to_table(L,&stat);
+}
+
+static int txn_record_drop(txn_ud* t,MDB_dbi dbi,int del) {
+  char flag = del ? 1 : 0;
+  MDB_val k,v;
+  k.mv_data = &flag;
+  k.mv_size = 0;
+  v.mv_data = &flag;
+  v.mv_size = 1;
+  return txn_record(t,'D',dbi,&k,&v);
+}
+
+static int txn_dbi_drop(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  int del = luaL_checkinteger(L,3);
+  size_t recorded = t->changes_len;
+  int err;
+  txn_touch(t,dbi);
+  if ( del ) {
+    txn_touch(t,MAIN_DBI);
+  }
+  err = txn_record_drop(t,dbi,del);
+  if ( !err ) {
+    err = mdb_drop(t->txn,dbi,del);
+  }
+  if ( err ) {
+    t->changes_len = recorded;
+  } else if ( del && t->ctx ) {
+    /* the handle is closed, and may be reused for another dbi */
+    env_ctx_set_name(t->ctx,dbi,NULL);
+  }
+  return success_or_err(L,err);
+}
+
+static int txn_get(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_val k,v;
+  int err;
+
+  if ( pop_val(L,3,&k) && ttl_expired(t,dbi,&k) ) {
+    lua_pushnil(L);
+    return 1;
+  }
+  if ( t->cache && !t->cache->dead && pop_val(L,3,&k) ) {
+    return cache_get(L,t,dbi,&k);
+  }
+  err = mdb_get(t->txn,dbi,pop_val(L,3,&k),&v);
+  switch (err) {
+  case MDB_NOTFOUND:
+    lua_pushnil(L);
+    return 1;
+  case 0:
+    lua_pushlstring(L,v.mv_data,v.mv_size);
+    return 1;
+  }
+  return error_and_out(L,err);
+}
+
+static int txn_put(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_val k,v;
+  unsigned int flags = luaL_checkinteger(L,5);
+  int expires = 0;
+  lua_Integer ttl = 0;
+  int err;
+
+  if ( lua_istable(L,6) ) {
+    lua_getfield(L,6,"ttl");
+    expires = !lua_isnil(L,-1);
+    ttl = expires ? luaL_checkinteger(L,-1) : 0;
+    lua_pop(L,1);
+  }
+  txn_touch(t,dbi);
+  err = mdb_put(t->txn,dbi,pop_val(L,3,&k),pop_val(L,4,&v),flags);
+  if ( !err ) {
+    err = txn_record(t,'p',dbi,&k,&v);
+  }
+  /* the last put decides whether the key expires */
+  if ( !err && expires ) {
+    err = ttl_set(t,dbi,&k,(uint64_t)(time(NULL)+ttl));
+  } else if ( !err ) {
+    err = ttl_forget(t,dbi,&k);
+  }
+  return success_or_err(L,err);
+}
+
+static int txn_del(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_val k,v;
+  MDB_val* pv;
+  int err;
+  pop_val(L,3,&k);
+  pv = pop_val(L,4,&v);
+  txn_touch(t,dbi);
+  err = mdb_del(t->txn,dbi,&k,pv);
+  if ( !err ) {
+    err = txn_record(t,'d',dbi,&k,pv);
+  }
+  if ( !err ) {
+    err = pv ? ttl_forget_if_gone(t,dbi,&k) : ttl_forget(t,dbi,&k);
+  }
+  return success_or_err(L,err);
+}
+
+/*
+ * txn:del_range(dbi,start,end,[opts]) deletes the keys in [start,end), either
+ * of which may be nil. All the values of a MDB_DUPSORT key go at once, and
+ * opts.limit caps the number of keys deleted. Returns the number of records
+ * deleted and whether the range may hold more of them.
+ */
+static int txn_del_range(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_val start,end,k,v;
+  MDB_val* pstart = pop_val(L,3,&start);
+  MDB_val* pend = pop_val(L,4,&end);
+  size_t limit = 0;
+  size_t keys = 0;
+  size_t count = 0;
+  unsigned int flags = 0;
+  MDB_cursor* cursor;
+  int err;
+
+  if ( lua_istable(L,5) ) {
+    limit = opt_field(L,5,"limit",0);
+  }
+  err = mdb_dbi_flags(t->txn,dbi,&flags);
+  if ( !err ) {
+    err = mdb_cursor_open(t->txn,dbi,&cursor);
+  }
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+
+  txn_touch(t,dbi);
+  while ( !limit || keys<limit ) {
+    size_t n = 1;
+    /* seeking again after every delete is cheap and immune to cursor quirks */
+    if ( pstart ) {
+      k = start;
+    }
+    err = mdb_cursor_get(cursor,&k,&v,pstart ? MDB_SET_RANGE : MDB_FIRST);
+    if ( err || (pend && mdb_cmp(t->txn,dbi,&k,pend)>=0) ) {
+      break;
+    }
+    if ( flags & MDB_DUPSORT ) {
+      err = mdb_cursor_count(cursor,&n);
+    }
+    if ( !err ) {
+      err = txn_record(t,'d',dbi,&k,NULL);
+    }
+    if ( !err ) {
+      err = ttl_forget(t,dbi,&k);
+    }
+    if ( !err ) {
+      err = mdb_cursor_del(cursor,(flags & MDB_DUPSORT) ? MDB_NODUPDATA : 0);
+    }
+    if ( err ) {
+      break;
+    }
+    ++keys;
+    count += n;
+  }
+  mdb_cursor_close(cursor);
+
+  if ( err && err!=MDB_NOTFOUND ) {
+    return error_and_out(L,err);
+  }
+  lua_pushinteger(L,count);
+  lua_pushboolean(L,err==0 && limit && keys==limit);
+  return 2;
+}
+
+static int txn_cmp_helper(lua_State* L,int mode) {
+  MDB_txn* txn = check_txn(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_val a,b;
+  pop_val(L,3,&a);
+  pop_val(L,4,&b);
+
+  if ( mode==MDB_DUPSORT )
+    return mdb_dcmp(txn,dbi,&a,&b);
+  return mdb_cmp(txn,dbi,&a,&b);
+}
+
+static int txn_cmp(lua_State* L) {
+  return txn_cmp_helper(L,0);
+}
+
+static int txn_dcmp(lua_State* L) {
+  return txn_cmp_helper(L,MDB_DUPSORT);
+}
+
+static int txn_id(lua_State* L) {
+  MDB_txn* txn = check_txn(L,1);
+  lua_pushinteger(L,mdb_txn_id(txn));
+  return 1;
+}
+
+static int txn_handle(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  return push_handle(L,t->txn,mdb_txn_env(t->txn),t->cache);
+}
+
+static int txn_cursor_open(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  MDB_cursor* cursor;
+  int err = mdb_cursor_open(t->txn,dbi,&cursor);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+
+  push_cursor(L,cursor,1);
+  return 1;
+}
+
+static int txn_cursor_renew(lua_State *L) {
+  txn_ud* t = check_txn_ud(L,1);
+  cursor_ud* c = check_cursor_ud(L,2);
+  int err = mdb_cursor_renew(t->txn,c->cursor);
+  if ( !err ) {
+    c->txn = t;
+    unanchor(L,&c->txn_ref);
+    c->txn_ref = anchor(L,1);
+    c->advised_from = c->advised_to = NULL;
+  }
+  return success_or_err(L,err);
+}
+
+/*
+ * time series are kept in MDB_DUPSORT (preferably also MDB_DUPFIXED) dbis,
+ * keyed by the series name, with each point being a big endian timestamp
+ * followed by a native double.
+ */
+#define TS_POINT_SIZE (8+sizeof(double))
+
+static const char* const ts_aggregates[] = {
+  "avg","sum","min","max","count","first","last",NULL
+};
+enum { TS_AVG, TS_SUM, TS_MIN, TS_MAX, TS_COUNT, TS_FIRST, TS_LAST };
+
+typedef struct {
+  uint64_t from;
+  uint64_t to;
+  uint64_t bucket;    /* 0 for raw points */
+  int agg;
+  uint64_t start;     /* of the current bucket */
+  size_t count;       /* of the current bucket */
+  double sum,min,max,first,last;
+  size_t points;      /* written to out */
+  txn_ud* t;
+  char* out;          /* in the txn's scratch memory */
+  size_t cap;
+  int err;
+} ts_reader;
+
+static void ts_emit(ts_reader* r,double ts,double value) {
+  size_t len = r->points*2*sizeof(double);
+  if ( len+2*sizeof(double)>r->cap ) {
+    size_t cap = r->cap ? 2*r->cap : 256*2*sizeof(double);
+    char* out = (char*)scratch_grow(r->t,r->out,r->cap,cap);
+    if ( !out ) {
+      r->err = ENOMEM;
+      return;
+    }
+    r->out = out;
+    r->cap = cap;
+  }
+  memcpy(r->out+len,&ts,sizeof(ts));
+  memcpy(r->out+len+sizeof(ts),&value,sizeof(value));
+  ++r->points;
+}
+
+static void ts_flush(ts_reader* r) {
+  double x = 0;
+  if ( !r->count ) {
+    return;
+  }
+  switch (r->agg) {
+  case TS_AVG: x = r->sum/r->count; break;
+  case TS_SUM: x = r->sum; break;
+  case TS_MIN: x = r->min; break;
+  case TS_MAX: x = r->max; break;
+  case TS_COUNT: x = r->count; break;
+  case TS_FIRST: x = r->first; break;
+  case TS_LAST: x = r->last; break;
+  }
+  ts_emit(r,(double)r->start,x);
+  r->count = 0;
+}
+
+/* returns non zero once past the end of the range */
+static int ts_read(ts_reader* r,const unsigned char* p) {
+  uint64_t ts = get_u64(p);
+  double value;
+  if ( ts<r->from ) {
+    return 0;
+  }
+  if ( ts>r->to ) {
+    return 1;
+  }
+  memcpy(&value,p+8,sizeof(value));
+  if ( !r->bucket ) {
+    ts_emit(r,(double)ts,value);
+    return 0;
+  }
+  if ( r->count && ts-r->start>=r->bucket ) {
+    ts_flush(r);
+  }
+  if ( !r->count ) {
+    r->start = ts-ts%r->bucket;
+    r->sum = 0;
+    r->min = r->max = r->first = value;
+  }
+  ++r->count;
+  r->sum += value;
+  r->last = value;
+  if ( value<r->min ) r->min = value;
+  if ( value>r->max ) r->max = value;
+  return 0;
+}
+
+static int txn_ts_append(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  lua_Integer ts = luaL_checkinteger(L,4);
+  double value = luaL_checknumber(L,5);
+  unsigned char point[TS_POINT_SIZE];
+  MDB_val k,v;
+  int err;
+
+  luaL_argcheck(L,ts>=0,4,"timestamp must not be negative");
+  k.mv_data = (void*)luaL_checklstring(L,3,&k.mv_size);
+  put_u64(point,(uint64_t)ts);
+  memcpy(point+8,&value,sizeof(value));
+  v.mv_data = point;
+  v.mv_size = TS_POINT_SIZE;
+  txn_touch(t,dbi);
+  err = mdb_put(t->txn,dbi,&k,&v,MDB_APPENDDUP);
+  if ( !err ) {
+    err = txn_record(t,'p',dbi,&k,&v);
+  }
+  return success_or_err(L,err);
+}
 
-static const luaL_Reg env_methods[] = {
+static int txn_ts_range(lua_State* L) {
+  txn_ud* t = check_txn_ud(L,1);
+  MDB_txn* txn = t->txn;
+  MDB_dbi dbi = luaL_checkinteger(L,2);
+  unsigned char probe[TS_POINT_SIZE];
+  unsigned int flags = 0;
+  MDB_cursor* cursor;
+  MDB_val k,v;
+  scratch_mark mark;
+  lua_Integer from = luaL_optinteger(L,4,0);
+  lua_Integer to = luaL_optinteger(L,5,0);
+  lua_Integer bucket = luaL_optinteger(L,6,0);
+  ts_reader r;
+  int done = 0;
+  int err;
+  size_t i;
+
+  k.mv_data = (void*)luaL_checklstring(L,3,&k.mv_size);
+  luaL_argcheck(L,from>=0,4,"timestamp must not be negative");
+  luaL_argcheck(L,lua_isnoneornil(L,5) || from<=to,5,"must not precede from");
+  luaL_argcheck(L,lua_isnoneornil(L,6) || bucket>=1,6,"must be positive");
+  memset(&r,0,sizeof(r));
+  r.from = (uint64_t)from;
+  r.to = lua_isnoneornil(L,5) ? UINT64_MAX : (uint64_t)to;
+  r.bucket = (uint64_t)bucket;
+  r.agg = luaL_checkoption(L,7,"avg",ts_aggregates);
+  r.t = t;
+  mark = scratch_save(t);
+
+  err = mdb_dbi_flags(txn,dbi,&flags);
+  if ( !err && !(flags & MDB_DUPSORT) ) {
+    err = MDB_INCOMPATIBLE;
+  }
+  if ( !err ) {
+    err = mdb_cursor_open(txn,dbi,&cursor);
+  }
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+
+  memset(probe,0,sizeof(probe));
+  put_u64(probe,r.from);
+  v.mv_data = probe;
+  v.mv_size = TS_POINT_SIZE;
+  err = mdb_cursor_get(cursor,&k,&v,MDB_GET_BOTH_RANGE);
+  if ( err==0 && (flags & MDB_DUPFIXED) ) {
+    /* a page worth of points at a time, starting with the cursor's page */
+    err = mdb_cursor_get(cursor,&k,&v,MDB_GET_MULTIPLE);
+    while ( err==0 && !done ) {
+      for (i=0; i+TS_POINT_SIZE<=v.mv_size && !done; i+=TS_POINT_SIZE) {
+        done = ts_read(&r,(const unsigned char*)v.mv_data+i) || r.err;
+      }
+      if ( !done ) {
+        err = mdb_cursor_get(cursor,&k,&v,MDB_NEXT_MULTIPLE);
+      }
+    }
+  } else {
+    while ( err==0 && !done ) {
+      if ( v.mv_size>=TS_POINT_SIZE ) {
+        done = ts_read(&r,(const unsigned char*)v.mv_data) || r.err;
+      }
+      if ( !done ) {
+        err = mdb_cursor_get(cursor,&k,&v,MDB_NEXT_DUP);
+      }
+    }
+  }
+  mdb_cursor_close(cursor);
+  if ( r.bucket && (err==0 || err==MDB_NOTFOUND) ) {
+    ts_flush(&r);
+  }
+  if ( r.err ) {
+    err = r.err;
+  }
+  if ( err && err!=MDB_NOTFOUND ) {
+    scratch_rewind(t,mark);
+    return error_and_out(L,err);
+  }
+
+  lua_pushlstring(L,r.out ? r.out : "",r.points*2*sizeof(double));
+  scratch_rewind(t,mark);
+  lua_pushinteger(L,r.points);
+  return 2;
+}
+
+static const luaL_Reg txn_methods[] = {
 #if LUA_VERSION_NUM >= 504
-  {"__close",env_close},
+  {"__close",txn_gc},
 #endif
-  {"__gc",env_close},
-  {"open",env_open},
-  {"copy",env_copy},
-  {"stat",env_stat},
-  {"info",env_info},
-  {"sync",env_sync},
-  {"close",env_close},
-  {"set_flags",env_set_flags},
-  {"get_flags",env_get_flags},
-  {"get_path",env_get_path},
-  {"set_mapsize",env_set_mapsize},
-  {"set_maxreaders",env_set_maxreaders},
-  {"get_maxreaders",env_get_maxreaders},
-  {"set_maxdbs",env_set_maxdbs},
-  {"txn_begin",env_txn_begin},
-  {"dbi_close",env_dbi_close},
+  {"__gc",txn_gc},
+  {"id",txn_id},
+  {"commit",txn_commit},
+  {"abort",txn_abort},
+  {"reset",txn_reset},
+  {"renew",txn_renew},
+  {"dbi_open",txn_dbi_open},
+  {"stat",txn_stat},
+  {"dbi_drop",txn_dbi_drop},
+  {"get",txn_get},
+  {"put",txn_put},
+  {"del",txn_del},
+  {"del_range",txn_del_range},
+  {"cmp",txn_cmp},
+  {"dcmp",txn_dcmp},
+  {"cursor_open",txn_cursor_open},
+  {"cursor_renew",txn_cursor_renew},
+  {"handle",txn_handle},
+  {"begin_nested",txn_begin_nested},
+  {"savepoint",txn_savepoint},
+  {"depth",txn_depth},
+  {"ts_append",txn_ts_append},
+  {"ts_range",txn_ts_range},
   {0,0}
 };
 
+DEFINE_register_methods(txn,TXN)
 
-DEFINE_register_methods(env,ENV)
+/* globals */
+static int lmdb_version(lua_State *L) {
+  const char* ver = mdb_version(NULL,NULL,NULL);
+  lua_pushstring(L,ver);
+  return 1;
+}
 
-/* cursor */
-static int cursor_close(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  mdb_cursor_close(cursor);
-  clean_metatable(L);
+/* a monotonic clock in seconds, for timing */
+static int lmdb_clock(lua_State *L) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  lua_pushnumber(L,(lua_Number)ts.tv_sec+(lua_Number)ts.tv_nsec/1e9);
+  return 1;
+}
+
+static int lmdb_strerror(lua_State *L) {
+  int err = luaL_checkinteger(L,1);
+  lua_pushstring(L,mdb_strerror(err));
+  return 1;
+}
+
+static int lmdb_env_create(lua_State *L) {
+  MDB_env* env = NULL;
+  int err = mdb_env_create(&env);
+  if ( err ) {
+    lua_pushnil(L);
+    lua_pushstring(L,mdb_strerror(err));
+    return 2;
+  }
+
+  push_env(L,env);
+  return 1;
+}
+
+/* the options of env_shared, read before shared_envs_lock is taken */
+typedef struct {
+  unsigned int flags;
+  int mode;
+  size_t mapsize;
+  unsigned int maxdbs;
+  unsigned int maxreaders;
+} shared_env_opts;
+
+static void shared_env_read_opts(lua_State *L,int index,shared_env_opts* o) {
+  o->flags = opt_field(L,index,"flags",0);
+  o->mode = opt_field(L,index,"mode",0644);
+  o->mapsize = opt_field(L,index,"mapsize",0);
+  o->maxdbs = opt_field(L,index,"maxdbs",0);
+  o->maxreaders = opt_field(L,index,"maxreaders",0);
+  lua_getfield(L,index,"notls");
+  if ( lua_isnil(L,-1) || lua_toboolean(L,-1) ) {
+    o->flags |= MDB_NOTLS;
+  }
+  lua_pop(L,1);
+}
+
+static int shared_env_open(MDB_env* env,const char* path,
+                           const shared_env_opts* o) {
+  int err = 0;
+  if ( o->mapsize ) {
+    err = mdb_env_set_mapsize(env,o->mapsize);
+  }
+  if ( !err && o->maxdbs ) {
+    err = mdb_env_set_maxdbs(env,o->maxdbs);
+  }
+  if ( !err && o->maxreaders ) {
+    err = mdb_env_set_maxreaders(env,o->maxreaders);
+  }
+  if ( !err ) {
+    err = mdb_env_open(env,path,o->flags,o->mode);
+  }
+  return err;
+}
+
+/*
+ * the registry key of path: its real path, or the real path of its directory
+ * followed by its name, for a file which doesn't exist yet (MDB_NOSUBDIR).
+ */
+static int shared_env_key(const char* path,char* key) {
+  char dir[PATH_MAX];
+  const char* parent = dir;
+  const char* base;
+  char* slash;
+  size_t len = strlen(path);
+
+  if ( realpath(path,key) ) {
+    return 0;
+  }
+  while ( len>1 && path[len-1]=='/' ) {
+    --len;
+  }
+  if ( len>=PATH_MAX ) {
+    return ENAMETOOLONG;
+  }
+  memcpy(dir,path,len);
+  dir[len] = 0;
+  slash = strrchr(dir,'/');
+  if ( !slash ) {
+    parent = ".";
+    base = dir;
+  } else if ( slash==dir ) {
+    parent = "/";
+    base = slash+1;
+  } else {
+    *slash = 0;
+    base = slash+1;
+  }
+  if ( !realpath(parent,key) ) {
+    return errno;
+  }
+  if ( strlen(key)+1+strlen(base)>=PATH_MAX ) {
+    return ENAMETOOLONG;
+  }
+  if ( strcmp(key,"/") ) {
+    strcat(key,"/");
+  }
+  strcat(key,base);
   return 0;
 }
 
-static int cursor_txn(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  MDB_txn* txn = mdb_cursor_txn(cursor);
-  (void)txn;
-  /* TODO - we'll need a mapping from MDB_txn* to the lua userdata */
-  return unimplemented(L);
+static int lmdb_env_shared(lua_State *L) {
+  const char* path = luaL_checkstring(L,1);
+  char resolved[PATH_MAX];
+  shared_env_opts opts;
+  env_ctx* ctx;
+  MDB_env* env = NULL;
+  int err = 0;
+
+  if ( lua_isnoneornil(L,2) ) {
+    lua_settop(L,1);
+    lua_newtable(L);
+  }
+  luaL_checktype(L,2,LUA_TTABLE);
+  /* may raise errors, so not while holding the lock */
+  shared_env_read_opts(L,2,&opts);
+  err = shared_env_key(path,resolved);
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  path = resolved;
+
+  pthread_mutex_lock(&shared_envs_lock);
+  for (ctx=shared_envs; ctx; ctx=ctx->next) {
+    if ( strcmp(ctx->path,path)==0 ) {
+      ++ctx->refs;
+      env = ctx->env;
+      break;
+    }
+  }
+  if ( !env ) {
+    ctx = env_ctx_new();
+    if ( ctx ) {
+      ctx->path = strdup(path);
+    }
+    err = (ctx && ctx->path) ? mdb_env_create(&env) : ENOMEM;
+    if ( !err ) {
+      err = shared_env_open(env,path,&opts);
+      if ( err ) {
+        mdb_env_close(env);
+        env = NULL;
+      }
+    }
+    if ( !err ) {
+      ctx->env = env;
+      ctx->refs = 1;
+      ctx->next = shared_envs;
+      shared_envs = ctx;
+      mdb_env_set_userctx(env,ctx);
+    } else {
+      env_ctx_free(ctx);
+    }
+  }
+  pthread_mutex_unlock(&shared_envs_lock);
+
+  if ( err ) {
+    return error_and_out(L,err);
+  }
+  push_env(L,env);
+  return 1;
 }
 
-static int cursor_dbi(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  MDB_dbi dbi = mdb_cursor_dbi(cursor);
-  lua_pushinteger(L,dbi);
+/* allocation tracking */
+
+/*
+ * tracking wraps the Lua state's allocator, and every method of the binding
+ * with a closure noting which op is running, so that it costs nothing while
+ * off. Op 0 stands for everything else, i.e. Lua code.
+ */
+#define ALLOC_MAX_OPS 192
+#define ALLOC_OP_NAME 40
+
+#if LUA_VERSION_NUM >= 502
+/* osize tells the type of the object being created */
+#define ALLOC_NEW_OBJECT(ptr,osize) \
+  (!(ptr) && (osize)>=LUA_TSTRING && (osize)<=LUA_TTHREAD)
+#else
+#define ALLOC_NEW_OBJECT(ptr,osize) (!(ptr))
+#endif
+
+typedef struct {
+  char name[ALLOC_OP_NAME];
+  size_t calls;
+  size_t bytes;
+  size_t objects;
+} alloc_op;
+
+typedef struct {
+  lua_Alloc f;        /* the allocator being tracked */
+  void* ud;
+  int op;             /* running */
+  int nops;
+  size_t current;     /* bytes held by the state */
+  size_t peak;
+  alloc_op ops[ALLOC_MAX_OPS];
+} alloc_tracker;
+
+static void* alloc_tracked(void* ud,void* ptr,size_t osize,size_t nsize) {
+  alloc_tracker* a = (alloc_tracker*)ud;
+  alloc_op* op = &a->ops[a->op];
+  void* p = a->f(a->ud,ptr,osize,nsize);
+  if ( !p && nsize ) {
+    return NULL;
+  }
+  if ( ALLOC_NEW_OBJECT(ptr,osize) ) {
+    ++op->objects;
+  }
+  if ( !ptr ) {
+    osize = 0;
+  }
+  if ( nsize>osize ) {
+    op->bytes += nsize-osize;
+  }
+  a->current = a->current+nsize>osize ? a->current+nsize-osize : 0;
+  if ( a->current>a->peak ) {
+    a->peak = a->current;
+  }
+  return p;
+}
+
+static alloc_tracker* alloc_get_tracker(lua_State* L) {
+  void* ud;
+  return lua_getallocf(L,&ud)==alloc_tracked ? (alloc_tracker*)ud : NULL;
+}
+
+/* the wrapped function and the op index are the upvalues */
+static int alloc_call(lua_State* L) {
+  alloc_tracker* a = alloc_get_tracker(L);
+  int op = (int)lua_tointeger(L,lua_upvalueindex(2));
+  int prev = 0;
+  int err;
+
+  if ( a ) {
+    prev = a->op;
+    a->op = op;
+    ++a->ops[op].calls;
+  }
+  lua_pushvalue(L,lua_upvalueindex(1));
+  lua_insert(L,1);
+  err = lua_pcall(L,lua_gettop(L)-1,LUA_MULTRET,0);
+  /* the call may have turned tracking off */
+  a = alloc_get_tracker(L);
+  if ( a ) {
+    a->op = prev;
+  }
+  if ( err ) {
+    return lua_error(L);
+  }
+  /* iterators are accounted for as a part of the op returning them */
+  if ( lua_gettop(L)>0 && lua_iscfunction(L,1) &&
+       lua_tocfunction(L,1)!=alloc_call ) {
+    lua_pushvalue(L,1);
+    lua_pushinteger(L,op);
+    lua_pushcclosure(L,alloc_call,2);
+    lua_replace(L,1);
+  }
+  return lua_gettop(L);
+}
+
+static void alloc_wrap(lua_State* L,alloc_tracker* a,const char* tname,
+                       const char* prefix) {
+  const char* name;
+  luaL_getmetatable(L,tname);
+  lua_pushnil(L);
+  while ( lua_next(L,-2) ) {
+    name = lua_type(L,-2)==LUA_TSTRING ? lua_tostring(L,-2) : "__";
+    if ( lua_iscfunction(L,-1) && lua_tocfunction(L,-1)!=alloc_call &&
+         strncmp(name,"__",2)!=0 && strncmp(name,"alloc_",6)!=0 ) {
+      int op = a->nops<ALLOC_MAX_OPS ? a->nops++ : 0;
+      if ( op ) {
+        snprintf(a->ops[op].name,ALLOC_OP_NAME,"%s.%s",prefix,name);
+      }
+      lua_pushinteger(L,op);
+      lua_pushcclosure(L,alloc_call,2);
+      lua_pushvalue(L,-2);
+      lua_insert(L,-2);
+      lua_rawset(L,-4);
+    } else {
+      lua_pop(L,1);
+    }
+  }
+  lua_pop(L,1);
+}
+
+static void alloc_unwrap(lua_State* L,const char* tname) {
+  luaL_getmetatable(L,tname);
+  lua_pushnil(L);
+  while ( lua_next(L,-2) ) {
+    if ( lua_iscfunction(L,-1) && lua_tocfunction(L,-1)==alloc_call ) {
+      lua_getupvalue(L,-1,1);
+      lua_remove(L,-2);
+      lua_pushvalue(L,-2);
+      lua_insert(L,-2);
+      lua_rawset(L,-4);
+    } else {
+      lua_pop(L,1);
+    }
+  }
+  lua_pop(L,1);
+}
+
+static int lmdb_alloc_tracking(lua_State* L) {
+  alloc_tracker* a = alloc_get_tracker(L);
+  luaL_checktype(L,1,LUA_TBOOLEAN);
+
+  if ( lua_toboolean(L,1) && !a ) {
+    a = (alloc_tracker*)calloc(1,sizeof(alloc_tracker));
+    if ( !a ) {
+      return error_and_out(L,ENOMEM);
+    }
+    a->f = lua_getallocf(L,&a->ud);
+    a->nops = 1;
+    strcpy(a->ops[0].name,"lua");
+    a->current = a->peak = (size_t)lua_gc(L,LUA_GCCOUNT,0)*1024+
+      lua_gc(L,LUA_GCCOUNTB,0);
+    lua_setallocf(L,alloc_tracked,a);
+    if ( !alloc_get_tracker(L) ) {
+      free(a);
+      return str_error_and_out(L,"the Lua state's allocator can't be replaced");
+    }
+    alloc_wrap(L,a,LIGHTNING,"lightningmdb");
+    alloc_wrap(L,a,ENV,"env");
+    alloc_wrap(L,a,TXN,"txn");
+    alloc_wrap(L,a,CURSOR,"cursor");
+    alloc_wrap(L,a,SHARDED,"sharded");
+  } else if ( !lua_toboolean(L,1) && a ) {
+    alloc_unwrap(L,LIGHTNING);
+    alloc_unwrap(L,ENV);
+    alloc_unwrap(L,TXN);
+    alloc_unwrap(L,CURSOR);
+    alloc_unwrap(L,SHARDED);
+    lua_setallocf(L,a->f,a->ud);
+    free(a);
+  }
+  lua_pushboolean(L,1);
   return 1;
 }
 
-static int cursor_get(lua_State *L) {
-  int with_value = (lua_gettop(L) > 3);
-  MDB_cursor* cursor = check_cursor(L,1);
+static int lmdb_alloc_stats(lua_State* L) {
+  alloc_tracker* a = alloc_get_tracker(L);
+  int i;
+  if ( !a ) {
+    return str_error_and_out(L,"allocation tracking is off");
+  }
+  lua_newtable(L);
+  lua_pushinteger(L,a->current);
+  lua_setfield(L,-2,"current");
+  lua_pushinteger(L,a->peak);
+  lua_setfield(L,-2,"peak");
+  lua_newtable(L);
+  for (i=0; i<a->nops; ++i) {
+    if ( !a->ops[i].calls && !a->ops[i].bytes ) {
+      continue;
+    }
+    lua_newtable(L);
+    lua_pushinteger(L,a->ops[i].calls);
+    lua_setfield(L,-2,"calls");
+    lua_pushinteger(L,a->ops[i].bytes);
+    lua_setfield(L,-2,"bytes");
+    lua_pushinteger(L,a->ops[i].objects);
+    lua_setfield(L,-2,"objects");
+    lua_setfield(L,-2,a->ops[i].name);
+  }
+  lua_setfield(L,-2,"ops");
+  return 1;
+}
+
+static int lmdb_alloc_reset(lua_State* L) {
+  alloc_tracker* a = alloc_get_tracker(L);
+  int i;
+  if ( !a ) {
+    return str_error_and_out(L,"allocation tracking is off");
+  }
+  for (i=0; i<a->nops; ++i) {
+    a->ops[i].calls = a->ops[i].bytes = a->ops[i].objects = 0;
+  }
+  a->peak = a->current;
+  lua_pushboolean(L,1);
+  return 1;
+}
+
+/* sorted merges */
+
+/*
+ * the iterators of intersect, union and join keep their state in a userdata,
+ * which is their first upvalue, followed by the cursors. All the cursors'
+ * dbis must share the key order of the first one.
+ */
+#define MERGE_MAX 32
+
+typedef struct {
   MDB_val k,v;
-  MDB_cursor_op op = luaL_checkinteger(L,with_value?4:3);
+  int valid;
+  int matched;
+  int dups;
+} merge_pos;
+
+typedef struct {
+  int n;
+  int started;
+  int done;
+  int first_only;     /* union: yields a single value per key */
+  MDB_val from;       /* union: the range of keys, when not NULL */
+  MDB_val to;
+  merge_pos pos[1];
+} merge_state;
+
+static merge_state* merge_get(lua_State* L,MDB_cursor** cursors) {
+  merge_state* m = (merge_state*)lua_touserdata(L,lua_upvalueindex(1));
+  int i;
+  for (i=0; i<m->n; ++i) {
+    cursors[i] = check_cursor(L,lua_upvalueindex(i+2));
+  }
+  return m;
+}
+
+static int merge_cmp(MDB_cursor** cursors,MDB_val* a,MDB_val* b) {
+  return mdb_cmp(mdb_cursor_txn(cursors[0]),mdb_cursor_dbi(cursors[0]),a,b);
+}
+
+/*
+ * moves the cursors forward until they all agree on a key, every one of them
+ * seeking the highest key held by the others. Keys that some cursor lacks are
+ * skipped without being read.
+ */
+static int merge_leapfrog(merge_state* m,MDB_cursor** cursors) {
+  int hi = 0;
+  int agreed = 0;
+  int i;
   int err;
-  pop_val(L,2,&k);
-  if (with_value) pop_val(L,3,&v);
-  err = mdb_cursor_get(cursor,&k,&v,op);
-  switch (err) {
-  case MDB_NOTFOUND:
+  for (i=1; i<m->n; ++i) {
+    if ( merge_cmp(cursors,&m->pos[i].k,&m->pos[hi].k)>0 ) {
+      hi = i;
+    }
+  }
+  for (i=0; agreed<m->n; i=(i+1)%m->n) {
+    if ( i!=hi && merge_cmp(cursors,&m->pos[i].k,&m->pos[hi].k)!=0 ) {
+      m->pos[i].k = m->pos[hi].k;
+      err = mdb_cursor_get(cursors[i],&m->pos[i].k,&m->pos[i].v,MDB_SET_RANGE);
+      if ( err ) {
+        return err;
+      }
+      if ( merge_cmp(cursors,&m->pos[i].k,&m->pos[hi].k)!=0 ) {
+        hi = i;
+        agreed = 0;
+      }
+    }
+    ++agreed;
+  }
+  return 0;
+}
+
+static int merge_end(lua_State* L,merge_state* m,int err) {
+  m->done = 1;
+  if ( err==MDB_NOTFOUND ) {
     lua_pushnil(L);
     return 1;
-  case 0:
-    lua_pushlstring(L,k.mv_data,k.mv_size);
-    lua_pushlstring(L,v.mv_data,v.mv_size);
-    return 2;
   }
   return error_and_out(L,err);
 }
 
-static int cursor_get_key(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  MDB_val k;
-  MDB_cursor_op op = luaL_checkinteger(L,3);
-  int err;
-  pop_val(L,2,&k);
-  err = mdb_cursor_get(cursor,&k,NULL,op);
-  switch (err) {
-  case MDB_NOTFOUND:
-    lua_pushnil(L);
-    return 1;
-  case 0:
-    lua_pushlstring(L,k.mv_data,k.mv_size);
-    return 1;
+static int intersect_iter(lua_State* L) {
+  MDB_cursor* cursors[MERGE_MAX];
+  merge_state* m = merge_get(L,cursors);
+  int i;
+  int err = 0;
+
+  if ( m->done ) {
+    return merge_end(L,m,MDB_NOTFOUND);
+  }
+  if ( !m->started ) {
+    m->started = 1;
+    for (i=0; i<m->n && !err; ++i) {
+      err = mdb_cursor_get(cursors[i],&m->pos[i].k,&m->pos[i].v,MDB_FIRST);
+    }
+  } else {
+    err = mdb_cursor_get(cursors[0],&m->pos[0].k,&m->pos[0].v,MDB_NEXT_NODUP);
+  }
+  if ( !err ) {
+    err = merge_leapfrog(m,cursors);
+  }
+  if ( err ) {
+    return merge_end(L,m,err);
+  }
+  lua_pushlstring(L,m->pos[0].k.mv_data,m->pos[0].k.mv_size);
+  for (i=0; i<m->n; ++i) {
+    lua_pushlstring(L,m->pos[i].v.mv_data,m->pos[i].v.mv_size);
+  }
+  return m->n+1;
+}
+
+static int union_iter(lua_State* L) {
+  MDB_cursor* cursors[MERGE_MAX];
+  merge_state* m = merge_get(L,cursors);
+  merge_pos* lo = NULL;
+  int i;
+  int err;
+
+  if ( m->done ) {
+    return merge_end(L,m,MDB_NOTFOUND);
+  }
+  /* only the cursors which yielded the previous key move */
+  for (i=0; i<m->n; ++i) {
+    merge_pos* p = &m->pos[i];
+    if ( !m->started || p->matched ) {
+      MDB_cursor_op op = MDB_NEXT_NODUP;
+      if ( !m->started ) {
+        op = m->from.mv_data ? MDB_SET_RANGE : MDB_FIRST;
+        p->k = m->from;
+      }
+      err = mdb_cursor_get(cursors[i],&p->k,&p->v,op);
+      if ( err && err!=MDB_NOTFOUND ) {
+        return merge_end(L,m,err);
+      }
+      p->valid = !err;
+    }
+    if ( p->valid && (!lo || merge_cmp(cursors,&p->k,&lo->k)<0) ) {
+      lo = p;
+    }
+  }
+  m->started = 1;
+  if ( !lo || (m->to.mv_data && merge_cmp(cursors,&lo->k,&m->to)>=0) ) {
+    return merge_end(L,m,MDB_NOTFOUND);
+  }
+  lua_pushlstring(L,lo->k.mv_data,lo->k.mv_size);
+  for (i=0; i<m->n; ++i) {
+    merge_pos* p = &m->pos[i];
+    p->matched = p->valid && merge_cmp(cursors,&p->k,&lo->k)==0;
+    if ( p->matched && m->first_only ) {
+      lua_pushlstring(L,p->v.mv_data,p->v.mv_size);
+      /* the other cursors move on as well, skipping the key */
+      for (++i; i<m->n; ++i) {
+        p = &m->pos[i];
+        p->matched = p->valid && merge_cmp(cursors,&p->k,&lo->k)==0;
+      }
+      return 2;
+    }
+    if ( p->matched ) {
+      lua_pushlstring(L,p->v.mv_data,p->v.mv_size);
+    } else if ( !m->first_only ) {
+      lua_pushnil(L);
+    }
+  }
+  return m->n+1;
+}
+
+static int join_iter(lua_State* L) {
+  MDB_cursor* cursors[2];
+  merge_state* m = merge_get(L,cursors);
+  merge_pos* a = &m->pos[0];
+  merge_pos* b = &m->pos[1];
+  int err;
+
+  if ( m->done ) {
+    return merge_end(L,m,MDB_NOTFOUND);
+  }
+  if ( !m->started ) {
+    m->started = 1;
+    err = mdb_cursor_get(cursors[0],&a->k,&a->v,MDB_FIRST);
+    if ( !err ) {
+      err = mdb_cursor_get(cursors[1],&b->k,&b->v,MDB_FIRST);
+    }
+  } else {
+    /* the next pair of values of the current key, b's changing first */
+    err = b->dups ? mdb_cursor_get(cursors[1],&b->k,&b->v,MDB_NEXT_DUP) :
+      MDB_NOTFOUND;
+    if ( err==MDB_NOTFOUND && a->dups ) {
+      err = mdb_cursor_get(cursors[0],&a->k,&a->v,MDB_NEXT_DUP);
+      if ( !err && b->dups ) {
+        err = mdb_cursor_get(cursors[1],&b->k,&b->v,MDB_FIRST_DUP);
+      }
+    }
+    if ( err==MDB_NOTFOUND ) {
+      err = mdb_cursor_get(cursors[0],&a->k,&a->v,MDB_NEXT_NODUP);
+    } else if ( !err ) {
+      goto found;
+    }
+  }
+  if ( !err ) {
+    err = merge_leapfrog(m,cursors);
+  }
+  if ( err ) {
+    return merge_end(L,m,err);
+  }
+ found:
+  lua_pushlstring(L,a->k.mv_data,a->k.mv_size);
+  lua_pushlstring(L,a->v.mv_data,a->v.mv_size);
+  lua_pushlstring(L,b->v.mv_data,b->v.mv_size);
+  return 3;
+}
+
+static int merge_new(lua_State* L,lua_CFunction iter,int min,int max) {
+  int n = lua_gettop(L);
+  merge_state* m;
+  unsigned int flags;
+  MDB_cursor* cursor;
+  int i;
+
+  luaL_argcheck(L,n>=min && n<=max,1,"wrong number of cursors");
+  m = (merge_state*)lua_newuserdata(L,sizeof(merge_state)+
+                                    sizeof(merge_pos)*(n-1));
+  memset(m,0,sizeof(merge_state)+sizeof(merge_pos)*(n-1));
+  m->n = n;
+  for (i=0; i<n; ++i) {
+    cursor = check_cursor(L,i+1);
+    if ( mdb_dbi_flags(mdb_cursor_txn(cursor),mdb_cursor_dbi(cursor),
+                       &flags)==0 ) {
+      m->pos[i].dups = (flags & MDB_DUPSORT)!=0;
+    }
+  }
+  lua_insert(L,1);
+  lua_pushcclosure(L,iter,n+1);
+  return 1;
+}
+
+static int lmdb_intersect(lua_State* L) {
+  return merge_new(L,intersect_iter,1,MERGE_MAX);
+}
+
+static int lmdb_union(lua_State* L) {
+  return merge_new(L,union_iter,1,MERGE_MAX);
+}
+
+static int lmdb_join(lua_State* L) {
+  return merge_new(L,join_iter,2,2);
+}
+
+/* sharded envs */
+
+/*
+ * writes are buffered per shard, in the calling Lua state, and applied by
+ * commit with a thread per shard, each beginning and committing its own write
+ * txn. A batch holds records of op | u32 flags | u32 klen | key | u32 vlen |
+ * val, vlen being CHANGE_NO_VALUE for dels of all of a key's values.
+ */
+#define SHARDS_MAX MERGE_MAX
+
+typedef struct {
+  MDB_env* env;
+  MDB_dbi dbi;
+  char* batch;
+  size_t len;
+  size_t cap;
+  int err;            /* of the last commit */
+} shard;
+
+typedef struct {
+  int n;
+  int hash_ref;       /* registry ref of the routing function */
+  shard shards[SHARDS_MAX];
+} sharded_ud;
+
+static sharded_ud* check_sharded(lua_State* L,int index) {
+  sharded_ud* s = (sharded_ud*)luaL_checkudata(L,index,SHARDED);
+  if ( !s->n ) {
+    luaL_argerror(L,index,"sharded env is closed");
   }
-  return error_and_out(L,err);
+  return s;
 }
 
-static int cursor_put(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  MDB_val k,v;
-  unsigned int flags = luaL_checkinteger(L,4);
-  int err;
-  pop_val(L,2,&k);
-  pop_val(L,3,&v);
-  err = mdb_cursor_put(cursor,&k,&v,flags);
-  return success_or_err(L,err);
+static shard* sharded_route(lua_State* L,sharded_ud* s,int index) {
+  lua_Integer h;
+  int isnum;
+  lua_rawgeti(L,LUA_REGISTRYINDEX,s->hash_ref);
+  lua_pushvalue(L,index);
+  lua_call(L,1,1);
+  h = lua_tointegerx(L,-1,&isnum);
+  if ( !isnum ) {
+    luaL_error(L,"the routing function must return an integer");
+  }
+  lua_pop(L,1);
+  /* C's % keeps the sign of a negative hash */
+  h %= s->n;
+  if ( h<0 ) {
+    h += s->n;
+  }
+  return &s->shards[h];
 }
 
-static int cursor_del(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  unsigned int flags = luaL_checkinteger(L,2);
-  int err = mdb_cursor_del(cursor,flags);
-  return success_or_err(L,err);
+static int shard_add(shard* sh,char op,unsigned int flags,MDB_val* k,
+                     MDB_val* v) {
+  size_t need = 1+4+4+k->mv_size+4+(v ? v->mv_size : 0);
+  unsigned char* p;
+  if ( sh->len+need>sh->cap ) {
+    size_t cap = sh->cap ? sh->cap : 4096;
+    char* batch;
+    while ( cap<sh->len+need ) {
+      cap *= 2;
+    }
+    batch = (char*)realloc(sh->batch,cap);
+    if ( !batch ) {
+      return ENOMEM;
+    }
+    sh->batch = batch;
+    sh->cap = cap;
+  }
+  p = (unsigned char*)sh->batch+sh->len;
+  *p++ = op;
+  put_u32(p,flags);
+  put_u32(p+4,k->mv_size);
+  memcpy(p+8,k->mv_data,k->mv_size);
+  p += 8+k->mv_size;
+  put_u32(p,v ? v->mv_size : CHANGE_NO_VALUE);
+  if ( v ) {
+    memcpy(p+4,v->mv_data,v->mv_size);
+  }
+  sh->len += need;
+  return 0;
 }
 
-static int cursor_count(lua_State *L) {
-  MDB_cursor* cursor = check_cursor(L,1);
-  size_t count = 0;
-  int err = mdb_cursor_count(cursor,&count);
-  if ( err ) {
-    return error_and_out(L,err);
+static void* shard_commit(void* arg) {
+  shard* sh = (shard*)arg;
+  const unsigned char* p = (const unsigned char*)sh->batch;
+  const unsigned char* end = p+sh->len;
+  unsigned int flags;
+  MDB_val k,v;
+  MDB_txn* txn = NULL;
+  char op;
+  int err = mdb_txn_begin(sh->env,NULL,0,&txn);
+
+  while ( !err && p<end ) {
+    op = *p++;
+    flags = get_u32(p);
+    k.mv_size = get_u32(p+4);
+    k.mv_data = (void*)(p+8);
+    p += 8+k.mv_size;
+    v.mv_size = get_u32(p);
+    v.mv_data = (void*)(p+4);
+    p += 4+(v.mv_size==CHANGE_NO_VALUE ? 0 : v.mv_size);
+    if ( op=='p' ) {
+      err = mdb_put(txn,sh->dbi,&k,&v,flags);
+    } else {
+      err = mdb_del(txn,sh->dbi,&k,v.mv_size==CHANGE_NO_VALUE ? NULL : &v);
+    }
+    /* a batch goes on past keys which are already there or already gone */
+    if ( err==MDB_KEYEXIST || err==MDB_NOTFOUND ) {
+      err = 0;
+    }
   }
-  lua_pushinteger(L,count);
-  return 1;
+  if ( err && txn ) {
+    mdb_txn_abort(txn);
+  } else if ( !err ) {
+    err = mdb_txn_commit(txn);
+  }
+  sh->err = err;
+  return NULL;
 }
 
-static const luaL_Reg cursor_methods[] = {
-#if LUA_VERSION_NUM >= 504
-  {"__close",cursor_close},
-#endif
-  {"__gc",cursor_close},
-  {"close",cursor_close},
-  {"txn",cursor_txn},
-  {"dbi",cursor_dbi},
-  {"get",cursor_get},
-  {"get_key",cursor_get_key},
-  {"put",cursor_put},
-  {"del",cursor_del},
-  {"count",cursor_count},
+static void sharded_close_envs(sharded_ud* s) {
+  int i;
+  for (i=0; i<s->n; ++i) {
+    if ( s->shards[i].env ) {
+      mdb_env_close(s->shards[i].env);
+    }
+    free(s->shards[i].batch);
+  }
+  s->n = 0;
+}
 
-  {0,0}
-};
+static int shard_open(shard* sh,const char* path,lua_State* L,int opts) {
+  unsigned int flags = MDB_NOTLS;
+  int mode = 420;
+  const char* name = NULL;
+  unsigned int dbi_flags = 0;
+  MDB_txn* txn;
+  int err = mdb_env_create(&sh->env);
 
-DEFINE_register_methods(cursor,CURSOR)
+  if ( !err && lua_istable(L,opts) ) {
+    flags |= (unsigned int)opt_field(L,opts,"flags",0);
+    mode = (int)opt_field(L,opts,"mode",mode);
+    dbi_flags = (unsigned int)opt_field(L,opts,"dbi_flags",0);
+    lua_getfield(L,opts,"name");
+    name = lua_tostring(L,-1);
+    lua_pop(L,1);
+    if ( opt_field(L,opts,"mapsize",0) ) {
+      err = mdb_env_set_mapsize(sh->env,(size_t)opt_field(L,opts,"mapsize",0));
+    }
+    if ( !err ) {
+      err = mdb_env_set_maxdbs(sh->env,(MDB_dbi)opt_field(L,opts,"maxdbs",
+                                                          name ? 1 : 0));
+    }
+    if ( !err && opt_field(L,opts,"maxreaders",0) ) {
+      err = mdb_env_set_maxreaders(sh->env,(unsigned int)
+                                   opt_field(L,opts,"maxreaders",0));
+    }
+  }
+  if ( !err ) {
+    err = mdb_env_open(sh->env,path,flags,mode);
+  }
+  if ( !err ) {
+    err = mdb_txn_begin(sh->env,NULL,0,&txn);
+  }
+  if ( !err ) {
+    /* name stays valid, opts still holds it */
+    err = mdb_dbi_open(txn,name,MDB_CREATE|dbi_flags,&sh->dbi);
+    if ( err ) {
+      mdb_txn_abort(txn);
+    } else {
+      err = mdb_txn_commit(txn);
+    }
+  }
+  return err;
+}
 
-/* txn */
+/*
+ * lightningmdb.sharded(paths,route,[opts]) opens an env per path, routing
+ * every key to the shard route(key) points at, modulo the number of shards.
+ */
+static int lmdb_sharded(lua_State* L) {
+  sharded_ud* s;
+  int n = 0;
+  int err = 0;
+  int i;
 
-static int txn_commit(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  int err = mdb_txn_commit(txn);
+  luaL_checktype(L,1,LUA_TTABLE);
+  luaL_checktype(L,2,LUA_TFUNCTION);
+  lua_settop(L,3);
+  s = (sharded_ud*)lua_newuserdata(L,sizeof(sharded_ud));
+  memset(s,0,sizeof(sharded_ud));
+  s->hash_ref = LUA_NOREF;
+  luaL_getmetatable(L,SHARDED);
+  lua_setmetatable(L,-2);
 
+  for (i=1; !err; ++i) {
+    lua_rawgeti(L,1,i);
+    if ( lua_isnil(L,-1) ) {
+      lua_pop(L,1);
+      break;
+    }
+    luaL_argcheck(L,i<=SHARDS_MAX,1,"too many shards");
+    luaL_argcheck(L,lua_type(L,-1)==LUA_TSTRING,1,"paths must be strings");
+    /* counted before opening so that a failure closes it too */
+    s->n = ++n;
+    err = shard_open(&s->shards[i-1],lua_tostring(L,-1),L,3);
+    lua_pop(L,1);
+  }
   if ( err ) {
+    sharded_close_envs(s);
     return error_and_out(L,err);
   }
-
-  clean_metatable(L);
-  lua_pushboolean(L,1);
+  luaL_argcheck(L,n>0,1,"no paths");
+  lua_pushvalue(L,2);
+  s->hash_ref = luaL_ref(L,LUA_REGISTRYINDEX);
   return 1;
 }
 
-static int txn_abort(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  mdb_txn_abort(txn);
-  clean_metatable(L);
+static int sharded_close(lua_State* L) {
+  sharded_ud* s = (sharded_ud*)luaL_checkudata(L,1,SHARDED);
+  sharded_close_envs(s);
+  luaL_unref(L,LUA_REGISTRYINDEX,s->hash_ref);
+  s->hash_ref = LUA_NOREF;
   return 0;
 }
 
-static int txn_reset(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  mdb_txn_reset(txn);
-  return 0;
+static int sharded_put(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  unsigned int flags = (unsigned int)luaL_optinteger(L,4,0);
+  shard* sh;
+  MDB_val k,v;
+  luaL_argcheck(L,!(flags & MDB_RESERVE),4,"MDB_RESERVE can't be buffered");
+  k.mv_data = (void*)luaL_checklstring(L,2,&k.mv_size);
+  v.mv_data = (void*)luaL_checklstring(L,3,&v.mv_size);
+  sh = sharded_route(L,s,2);
+  return success_or_err(L,shard_add(sh,'p',flags,&k,&v));
 }
 
-static int txn_renew(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  mdb_txn_renew(txn);
-  return 0;
+static int sharded_del(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  shard* sh;
+  MDB_val k,v;
+  MDB_val* pv;
+  k.mv_data = (void*)luaL_checklstring(L,2,&k.mv_size);
+  pv = pop_val(L,3,&v);
+  sh = sharded_route(L,s,2);
+  return success_or_err(L,shard_add(sh,'d',0,&k,pv));
 }
 
-static int txn_dbi_open(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  const char* name = lua_isnil(L,2) ? NULL : luaL_checkstring(L,2);
-  unsigned int flags = luaL_checkinteger(L,3);
-  MDB_dbi dbi;
-  int err = mdb_dbi_open(txn,name,flags,&dbi);
-  if ( err ) {
-    return error_and_out(L,err);
+/* commits the buffered writes, a thread per shard having any */
+static int sharded_commit(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  pthread_t threads[SHARDS_MAX];
+  int started[SHARDS_MAX];
+  int pending = 0;
+  int err = 0;
+  int i;
+
+  for (i=0; i<s->n; ++i) {
+    pending += s->shards[i].len>0;
+  }
+  for (i=0; i<s->n; ++i) {
+    shard* sh = &s->shards[i];
+    started[i] = 0;
+    sh->err = 0;
+    if ( !sh->len ) {
+      continue;
+    }
+    /* a single shard, or a thread that can't be had, commits right here */
+    if ( pending>1 && pthread_create(&threads[i],NULL,shard_commit,sh)==0 ) {
+      started[i] = 1;
+    } else {
+      shard_commit(sh);
+    }
+  }
+  for (i=0; i<s->n; ++i) {
+    shard* sh = &s->shards[i];
+    if ( started[i] ) {
+      pthread_join(threads[i],NULL);
+    }
+    /* a failed batch is kept, to be committed again or aborted */
+    if ( sh->err ) {
+      err = sh->err;
+    } else {
+      sh->len = 0;
+    }
+  }
+  if ( !err ) {
+    return success_or_err(L,0);
   }
 
-  lua_pushinteger(L,dbi);
-  return 1;
+  lua_pushnil(L);
+  lua_newtable(L);
+  for (i=0; i<s->n; ++i) {
+    if ( s->shards[i].err ) {
+      lua_pushstring(L,mdb_strerror(s->shards[i].err));
+      lua_rawseti(L,-2,i+1);
+    }
+  }
+  return 2;
 }
 
-static int txn_stat(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
-  MDB_stat stat;
-  mdb_stat(txn,dbi,&stat);
-  return stat_to_table(L,&stat);
+static int sharded_abort(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  int i;
+  for (i=0; i<s->n; ++i) {
+    s->shards[i].len = 0;
+  }
+  return success_or_err(L,0);
 }
 
-static int txn_dbi_drop(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
-  int del = luaL_checkinteger(L,3);
-  int err = mdb_drop(txn,dbi,del);
-  return success_or_err(L,err);
+/* returns the snapshot's txn of shard i, pushing nothing */
+static MDB_txn* sharded_snapshot_txn(lua_State* L,int index,int i) {
+  MDB_txn* txn;
+  lua_rawgeti(L,index,i+1);
+  txn = check_txn(L,-1);
+  lua_pop(L,1);
+  return txn;
 }
 
-static int txn_get(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
+static int sharded_get(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  shard* sh;
+  MDB_txn* txn;
   MDB_val k,v;
   int err;
+  k.mv_data = (void*)luaL_checklstring(L,2,&k.mv_size);
+  sh = sharded_route(L,s,2);
 
-  err = mdb_get(txn,dbi,pop_val(L,3,&k),&v);
+  if ( lua_istable(L,3) ) {
+    txn = sharded_snapshot_txn(L,3,(int)(sh-s->shards));
+  } else {
+    err = mdb_txn_begin(sh->env,NULL,MDB_RDONLY,&txn);
+    if ( err ) {
+      return error_and_out(L,err);
+    }
+  }
+  err = mdb_get(txn,sh->dbi,&k,&v);
+  if ( err==0 ) {
+    lua_pushlstring(L,v.mv_data,v.mv_size);
+  }
+  if ( !lua_istable(L,3) ) {
+    mdb_txn_abort(txn);
+  }
   switch (err) {
   case MDB_NOTFOUND:
     lua_pushnil(L);
     return 1;
   case 0:
-    lua_pushlstring(L,v.mv_data,v.mv_size);
     return 1;
   }
   return error_and_out(L,err);
 }
 
-static int txn_put(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
-  MDB_val k,v;
-  unsigned int flags = luaL_checkinteger(L,5);
-  int err;
-
-  err = mdb_put(txn,dbi,pop_val(L,3,&k),pop_val(L,4,&v),flags);
-  return success_or_err(L,err);
-}
-
-static int txn_del(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
-  MDB_val k,v;
+/* a read txn per shard, all begun one after the other */
+static int sharded_snapshot(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  MDB_txn* txn;
+  txn_ud* t;
   int err;
-  pop_val(L,3,&k);
-  err = mdb_del(txn,dbi,&k,pop_val(L,4,&v));
-  return success_or_err(L,err);
-}
-
-static int txn_cmp_helper(lua_State* L,int mode) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
-  MDB_val a,b;
-  pop_val(L,3,&a);
-  pop_val(L,4,&b);
-
-  if ( mode==MDB_DUPSORT )
-    return mdb_dcmp(txn,dbi,&a,&b);
-  return mdb_cmp(txn,dbi,&a,&b);
-}
-
-static int txn_cmp(lua_State* L) {
-  return txn_cmp_helper(L,0);
-}
+  int i;
 
-static int txn_dcmp(lua_State* L) {
-  return txn_cmp_helper(L,MDB_DUPSORT);
+  lua_newtable(L);
+  for (i=0; i<s->n; ++i) {
+    err = mdb_txn_begin(s->shards[i].env,NULL,MDB_RDONLY,&txn);
+    if ( err ) {
+      for (--i; i>=0; --i) {
+        mdb_txn_abort(sharded_snapshot_txn(L,-1,i));
+        lua_rawgeti(L,-1,i+1);
+        clean_metatable(L);
+        lua_pop(L,1);
+      }
+      return error_and_out(L,err);
+    }
+    t = push_txn(L,txn,0);
+    t->rdonly = 1;
+    lua_rawseti(L,-2,i+1);
+  }
+  return 1;
 }
 
-static int txn_id(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  lua_pushinteger(L,mdb_txn_id(txn));
+static int sharded_dbi(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  lua_pushinteger(L,s->shards[0].dbi);
   return 1;
 }
 
-static int txn_cursor_open(lua_State* L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_dbi dbi = luaL_checkinteger(L,2);
+/*
+ * sharded:pairs(snapshot,[from],[to]) iterates over the keys in [from,to) of
+ * all the shards in order, using the union of the snapshot's cursors.
+ */
+static int sharded_pairs(lua_State* L) {
+  sharded_ud* s = check_sharded(L,1);
+  merge_state* m;
   MDB_cursor* cursor;
-  int err = mdb_cursor_open(txn,dbi,&cursor);
-  if ( err ) {
-    return error_and_out(L,err);
-  }
-
-  set_meta_and_return(cursor,CURSOR);
-}
+  txn_ud* t;
+  size_t len;
+  int err;
+  int i;
 
-static int txn_cursor_renew(lua_State *L) {
-  MDB_txn* txn = check_txn(L,1);
-  MDB_cursor* cursor = check_cursor(L,2);
-  int err = mdb_cursor_renew(txn,cursor);
-  return success_or_err(L,err);
+  luaL_checktype(L,2,LUA_TTABLE);
+  lua_settop(L,4);
+  m = (merge_state*)lua_newuserdata(L,sizeof(merge_state)+
+                                    sizeof(merge_pos)*(s->n-1));
+  memset(m,0,sizeof(merge_state)+sizeof(merge_pos)*(s->n-1));
+  m->first_only = 1;
+  if ( !lua_isnil(L,3) ) {
+    m->from.mv_data = (void*)luaL_checklstring(L,3,&len);
+    m->from.mv_size = len;
+  }
+  if ( !lua_isnil(L,4) ) {
+    m->to.mv_data = (void*)luaL_checklstring(L,4,&len);
+    m->to.mv_size = len;
+  }
+  for (i=0; i<s->n; ++i) {
+    lua_rawgeti(L,2,i+1);
+    t = check_txn_ud(L,-1);
+    err = mdb_cursor_open(t->txn,s->shards[i].dbi,&cursor);
+    if ( err ) {
+      return error_and_out(L,err);
+    }
+    push_cursor(L,cursor,-1);
+    lua_remove(L,-2);
+    m->n = i+1;
+  }
+  /* the bounds are upvalues as well, keeping the keys m points at alive */
+  lua_pushvalue(L,3);
+  lua_pushvalue(L,4);
+  lua_pushcclosure(L,union_iter,s->n+3);
+  return 1;
 }
 
-static const luaL_Reg txn_methods[] = {
+static const luaL_Reg sharded_methods[] = {
 #if LUA_VERSION_NUM >= 504
-  {"__close",clean_metatable},
+  {"__close",sharded_close},
 #endif
-  {"__gc",clean_metatable},
-  {"id",txn_id},
-  {"commit",txn_commit},
-  {"abort",txn_abort},
-  {"reset",txn_reset},
-  {"renew",txn_renew},
-  {"dbi_open",txn_dbi_open},
-  {"stat",txn_stat},
-  {"dbi_drop",txn_dbi_drop},
-  {"get",txn_get},
-  {"put",txn_put},
-  {"del",txn_del},
-  {"cmp",txn_cmp},
-  {"dcmp",txn_dcmp},
-  {"cursor_open",txn_cursor_open},
-  {"cursor_renew",txn_cursor_renew},
+  {"__gc",sharded_close},
+  {"close",sharded_close},
+  {"put",sharded_put},
+  {"del",sharded_del},
+  {"commit",sharded_commit},
+  {"abort",sharded_abort},
+  {"get",sharded_get},
+  {"snapshot",sharded_snapshot},
+  {"pairs",sharded_pairs},
+  {"dbi",sharded_dbi},
   {0,0}
 };
 
-DEFINE_register_methods(txn,TXN)
+DEFINE_register_methods(sharded,SHARDED)
 
-/* globals */
-static int lmdb_version(lua_State *L) {
-  const char* ver = mdb_version(NULL,NULL,NULL);
-  lua_pushstring(L,ver);
-  return 1;
+/* column reductions */
+
+/*
+ * the loops keep four independent accumulators, so the compiler is free to
+ * hold them in a single SIMD register, without reassociating the additions.
+ */
+static const char* column_check(lua_State* L,int index,size_t* n) {
+  size_t len;
+  const char* p = luaL_checklstring(L,index,&len);
+  luaL_argcheck(L,len%sizeof(double)==0,index,"not a column");
+  *n = len/sizeof(double);
+  return p;
 }
 
-static int lmdb_strerror(lua_State *L) {
-  int err = luaL_checkinteger(L,1);
-  lua_pushstring(L,mdb_strerror(err));
+/* Lua strings needn't be aligned for doubles */
+static double column_at(const char* p,size_t i) {
+  double x;
+  memcpy(&x,p+i*sizeof(double),sizeof(x));
+  return x;
+}
+
+static int lmdb_column_sum(lua_State* L) {
+  size_t n,i;
+  const char* p = column_check(L,1,&n);
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (i=0; i+4<=n; i+=4) {
+    s0 += column_at(p,i);
+    s1 += column_at(p,i+1);
+    s2 += column_at(p,i+2);
+    s3 += column_at(p,i+3);
+  }
+  for (; i<n; ++i) {
+    s0 += column_at(p,i);
+  }
+  lua_pushnumber(L,(s0+s1)+(s2+s3));
   return 1;
 }
 
-static int lmdb_env_create(lua_State *L) {
-  MDB_env* env = NULL;
-  int err = mdb_env_create(&env);
-  if ( err ) {
+static int column_extreme(lua_State* L,int max) {
+  size_t n,i;
+  const char* p = column_check(L,1,&n);
+  double m[4];
+  double x;
+  int j;
+  if ( !n ) {
     lua_pushnil(L);
-    lua_pushstring(L,mdb_strerror(err));
-    return 2;
+    return 1;
+  }
+  for (j=0; j<4; ++j) {
+    m[j] = column_at(p,0);
   }
+  for (i=0; i+4<=n; i+=4) {
+    for (j=0; j<4; ++j) {
+      x = column_at(p,i+j);
+      m[j] = (max ? x>m[j] : x<m[j]) ? x : m[j];
+    }
+  }
+  for (; i<n; ++i) {
+    x = column_at(p,i);
+    m[0] = (max ? x>m[0] : x<m[0]) ? x : m[0];
+  }
+  for (j=1; j<4; ++j) {
+    m[0] = (max ? m[j]>m[0] : m[j]<m[0]) ? m[j] : m[0];
+  }
+  lua_pushnumber(L,m[0]);
+  return 1;
+}
+
+static int lmdb_column_min(lua_State* L) {
+  return column_extreme(L,0);
+}
+
+static int lmdb_column_max(lua_State* L) {
+  return column_extreme(L,1);
+}
 
-  set_meta_and_return(env,ENV);
+static int lmdb_column_dot(lua_State* L) {
+  size_t n,m,i;
+  const char* a = column_check(L,1,&n);
+  const char* b = column_check(L,2,&m);
+  double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  luaL_argcheck(L,n==m,2,"columns differ in length");
+  for (i=0; i+4<=n; i+=4) {
+    s0 += column_at(a,i)*column_at(b,i);
+    s1 += column_at(a,i+1)*column_at(b,i+1);
+    s2 += column_at(a,i+2)*column_at(b,i+2);
+    s3 += column_at(a,i+3)*column_at(b,i+3);
+  }
+  for (; i<n; ++i) {
+    s0 += column_at(a,i)*column_at(b,i);
+  }
+  lua_pushnumber(L,(s0+s1)+(s2+s3));
+  return 1;
 }
 
 static const luaL_Reg globals[] = {
   {"version",lmdb_version},
   {"strerror",lmdb_strerror},
+  {"clock",lmdb_clock},
   {"env_create",lmdb_env_create},
+  {"env_shared",lmdb_env_shared},
+  {"intersect",lmdb_intersect},
+  {"union",lmdb_union},
+  {"join",lmdb_join},
+  {"sharded",lmdb_sharded},
+  {"column_sum",lmdb_column_sum},
+  {"column_min",lmdb_column_min},
+  {"column_max",lmdb_column_max},
+  {"column_dot",lmdb_column_dot},
+  {"alloc_tracking",lmdb_alloc_tracking},
+  {"alloc_stats",lmdb_alloc_stats},
+  {"alloc_reset",lmdb_alloc_reset},
   {NULL,  NULL}
 };
 
@@ -694,6 +4149,7 @@ int luaopen_lightningmdb(lua_State *L) {
   env_register(L);
   txn_register(L);
   cursor_register(L);
+  sharded_register(L);
   luaL_getmetatable(L,LIGHTNING);
   return 1;
 }
@@ -0,0 +1,420 @@
+--
+-- LuaJIT FFI binding of LMDB, mirroring the env/txn/cursor surface of
+-- lightningmdb. Calls through the FFI can be compiled by LuaJIT, unlike calls
+-- through the Lua C API, so hot loops of get/put/cursor calls stay on trace.
+--
+-- The objects are cdata pointers to the MDB_ handles. Objects created by
+-- lightningmdb can be wrapped using env(), txn() and cursor(), and both
+-- bindings may be used side by side on them. The lightningmdb only features
+-- (change capture, key expiry and the hot key cache) would be bypassed by the
+-- FFI calls, so objects of envs using them can't be wrapped, and they can't be
+-- enabled on an env once any of its objects was wrapped.
+--
+
+local ffi = require "ffi"
+local lightningmdb = require "lightningmdb"
+
+ffi.cdef[[
+typedef unsigned int mdb_mode_t;
+typedef struct MDB_env MDB_env;
+typedef struct MDB_txn MDB_txn;
+typedef unsigned int MDB_dbi;
+typedef struct MDB_cursor MDB_cursor;
+typedef struct MDB_val {
+  size_t mv_size;
+  void *mv_data;
+} MDB_val;
+typedef struct MDB_stat {
+  unsigned int ms_psize;
+  unsigned int ms_depth;
+  size_t ms_branch_pages;
+  size_t ms_leaf_pages;
+  size_t ms_overflow_pages;
+  size_t ms_entries;
+} MDB_stat;
+typedef struct MDB_envinfo {
+  void *me_mapaddr;
+  size_t me_mapsize;
+  size_t me_last_pgno;
+  size_t me_last_txnid;
+  unsigned int me_maxreaders;
+  unsigned int me_numreaders;
+} MDB_envinfo;
+
+char *mdb_strerror(int err);
+int mdb_env_create(MDB_env **env);
+int mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_mode_t mode);
+int mdb_env_copy(MDB_env *env, const char *path);
+int mdb_env_stat(MDB_env *env, MDB_stat *stat);
+int mdb_env_info(MDB_env *env, MDB_envinfo *stat);
+int mdb_env_sync(MDB_env *env, int force);
+void mdb_env_close(MDB_env *env);
+int mdb_env_set_flags(MDB_env *env, unsigned int flags, int onoff);
+int mdb_env_get_flags(MDB_env *env, unsigned int *flags);
+int mdb_env_get_path(MDB_env *env, const char **path);
+int mdb_env_set_mapsize(MDB_env *env, size_t size);
+int mdb_env_set_maxreaders(MDB_env *env, unsigned int readers);
+int mdb_env_get_maxreaders(MDB_env *env, unsigned int *readers);
+int mdb_env_set_maxdbs(MDB_env *env, MDB_dbi dbs);
+int mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **txn);
+size_t mdb_txn_id(MDB_txn *txn);
+int mdb_txn_commit(MDB_txn *txn);
+void mdb_txn_abort(MDB_txn *txn);
+void mdb_txn_reset(MDB_txn *txn);
+int mdb_txn_renew(MDB_txn *txn);
+int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *dbi);
+int mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *stat);
+void mdb_dbi_close(MDB_env *env, MDB_dbi dbi);
+int mdb_drop(MDB_txn *txn, MDB_dbi dbi, int del);
+int mdb_get(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
+int mdb_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, unsigned int flags);
+int mdb_del(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
+int mdb_cmp(MDB_txn *txn, MDB_dbi dbi, const MDB_val *a, const MDB_val *b);
+int mdb_dcmp(MDB_txn *txn, MDB_dbi dbi, const MDB_val *a, const MDB_val *b);
+int mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **cursor);
+void mdb_cursor_close(MDB_cursor *cursor);
+int mdb_cursor_renew(MDB_txn *txn, MDB_cursor *cursor);
+MDB_dbi mdb_cursor_dbi(MDB_cursor *cursor);
+int mdb_cursor_get(MDB_cursor *cursor, MDB_val *key, MDB_val *data, int op);
+int mdb_cursor_put(MDB_cursor *cursor, MDB_val *key, MDB_val *data, unsigned int flags);
+int mdb_cursor_del(MDB_cursor *cursor, unsigned int flags);
+int mdb_cursor_count(MDB_cursor *cursor, size_t *countp);
+]]
+
+-- lightningmdb is loaded with RTLD_LOCAL, so liblmdb is loaded again here,
+-- from $LIGHTNINGMDB_LMDB when set, by its development or its runtime name, or
+-- from lightningmdb itself when liblmdb was linked into it statically
+local function load_lmdb()
+  local names = {os.getenv("LIGHTNINGMDB_LMDB"),"lmdb","liblmdb.so.0",
+                 package.searchpath and package.searchpath("lightningmdb",package.cpath)}
+  local errs = {}
+  for i=1,4 do
+    if names[i] then
+      local ok,lib = pcall(ffi.load,names[i])
+      if ok and pcall(function() return lib.mdb_env_create end) then
+        return lib
+      end
+      errs[#errs+1] = tostring(lib)
+    end
+  end
+  error("can't load liblmdb: "..table.concat(errs,"; "))
+end
+
+local C = load_lmdb()
+
+local MDB_NOTFOUND = lightningmdb.MDB_NOTFOUND
+
+-- scratch space, the calls below never yield in between using them
+local k = ffi.new("MDB_val[1]")
+local v = ffi.new("MDB_val[1]")
+local env_p = ffi.new("MDB_env*[1]")
+local txn_p = ffi.new("MDB_txn*[1]")
+local cursor_p = ffi.new("MDB_cursor*[1]")
+local dbi_p = ffi.new("MDB_dbi[1]")
+local uint_p = ffi.new("unsigned int[1]")
+local size_p = ffi.new("size_t[1]")
+local path_p = ffi.new("const char*[1]")
+
+local function error_and_out(err)
+  return nil,ffi.string(C.mdb_strerror(err)),err
+end
+
+local function success_or_err(self,err)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return self
+end
+
+local function set_val(val,s)
+  if s==nil then
+    return nil
+  end
+  val[0].mv_size = #s
+  val[0].mv_data = ffi.cast("void*",s)
+  return val
+end
+
+local function val_string(val)
+  return ffi.string(val[0].mv_data,val[0].mv_size)
+end
+
+local function stat_to_table(stat)
+  return {
+    ms_psize = stat.ms_psize,
+    ms_depth = stat.ms_depth,
+    ms_branch_pages = tonumber(stat.ms_branch_pages),
+    ms_leaf_pages = tonumber(stat.ms_leaf_pages),
+    ms_overflow_pages = tonumber(stat.ms_overflow_pages),
+    ms_entries = tonumber(stat.ms_entries),
+  }
+end
+
+-- env
+local env_methods = {}
+
+function env_methods:open(path,flags,mode)
+  return success_or_err(self,C.mdb_env_open(self,path,flags,mode))
+end
+
+function env_methods:copy(path)
+  return success_or_err(self,C.mdb_env_copy(self,path))
+end
+
+function env_methods:stat()
+  local stat = ffi.new("MDB_stat")
+  C.mdb_env_stat(self,stat)
+  return stat_to_table(stat)
+end
+
+function env_methods:info()
+  local info = ffi.new("MDB_envinfo")
+  C.mdb_env_info(self,info)
+  return {
+    me_mapsize = tonumber(info.me_mapsize),
+    me_last_pgno = tonumber(info.me_last_pgno),
+    me_last_txnid = tonumber(info.me_last_txnid),
+    me_maxreaders = info.me_maxreaders,
+    me_numreaders = info.me_numreaders,
+  }
+end
+
+function env_methods:sync(force)
+  return success_or_err(self,C.mdb_env_sync(self,force))
+end
+
+function env_methods:close()
+  C.mdb_env_close(self)
+end
+
+function env_methods:set_flags(flags,onoff)
+  return success_or_err(self,C.mdb_env_set_flags(self,flags,onoff))
+end
+
+function env_methods:get_flags()
+  local err = C.mdb_env_get_flags(self,uint_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return uint_p[0]
+end
+
+function env_methods:get_path()
+  local err = C.mdb_env_get_path(self,path_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return ffi.string(path_p[0])
+end
+
+function env_methods:set_mapsize(size)
+  return success_or_err(self,C.mdb_env_set_mapsize(self,size))
+end
+
+function env_methods:set_maxreaders(readers)
+  return success_or_err(self,C.mdb_env_set_maxreaders(self,readers))
+end
+
+function env_methods:get_maxreaders()
+  local err = C.mdb_env_get_maxreaders(self,uint_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return uint_p[0]
+end
+
+function env_methods:set_maxdbs(num)
+  return success_or_err(self,C.mdb_env_set_maxdbs(self,num))
+end
+
+function env_methods:txn_begin(parent,flags)
+  local err = C.mdb_txn_begin(self,parent,flags,txn_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return txn_p[0]
+end
+
+function env_methods:dbi_close(dbi)
+  C.mdb_dbi_close(self,dbi)
+end
+
+-- txn
+local txn_methods = {}
+
+function txn_methods:id()
+  return tonumber(C.mdb_txn_id(self))
+end
+
+function txn_methods:commit()
+  local err = C.mdb_txn_commit(self)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return true
+end
+
+function txn_methods:abort()
+  C.mdb_txn_abort(self)
+end
+
+function txn_methods:reset()
+  C.mdb_txn_reset(self)
+end
+
+function txn_methods:renew()
+  C.mdb_txn_renew(self)
+end
+
+function txn_methods:dbi_open(name,flags)
+  local err = C.mdb_dbi_open(self,name,flags,dbi_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return dbi_p[0]
+end
+
+function txn_methods:stat(dbi)
+  local stat = ffi.new("MDB_stat")
+  C.mdb_stat(self,dbi,stat)
+  return stat_to_table(stat)
+end
+
+function txn_methods:dbi_drop(dbi,del)
+  return success_or_err(self,C.mdb_drop(self,dbi,del))
+end
+
+function txn_methods:get(dbi,key)
+  local err = C.mdb_get(self,dbi,set_val(k,key),v)
+  if err==0 then
+    return val_string(v)
+  elseif err==MDB_NOTFOUND then
+    return nil
+  end
+  return error_and_out(err)
+end
+
+function txn_methods:put(dbi,key,value,flags)
+  return success_or_err(self,C.mdb_put(self,dbi,set_val(k,key),set_val(v,value),flags))
+end
+
+function txn_methods:del(dbi,key,value)
+  return success_or_err(self,C.mdb_del(self,dbi,set_val(k,key),set_val(v,value)))
+end
+
+function txn_methods:cmp(dbi,a,b)
+  return C.mdb_cmp(self,dbi,set_val(k,a),set_val(v,b))
+end
+
+function txn_methods:dcmp(dbi,a,b)
+  return C.mdb_dcmp(self,dbi,set_val(k,a),set_val(v,b))
+end
+
+function txn_methods:cursor_open(dbi)
+  local err = C.mdb_cursor_open(self,dbi,cursor_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return cursor_p[0]
+end
+
+function txn_methods:cursor_renew(cursor)
+  return success_or_err(self,C.mdb_cursor_renew(self,cursor))
+end
+
+-- cursor
+local cursor_methods = {}
+
+function cursor_methods:close()
+  C.mdb_cursor_close(self)
+end
+
+function cursor_methods:dbi()
+  return C.mdb_cursor_dbi(self)
+end
+
+function cursor_methods:get(key,value,op)
+  if op==nil then
+    op,value = value,nil
+  end
+  if key~=nil then
+    set_val(k,key)
+  end
+  if value~=nil then
+    set_val(v,value)
+  end
+  local err = C.mdb_cursor_get(self,k,v,op)
+  if err==0 then
+    return val_string(k),val_string(v)
+  elseif err==MDB_NOTFOUND then
+    return nil
+  end
+  return error_and_out(err)
+end
+
+function cursor_methods:get_key(key,op)
+  if key~=nil then
+    set_val(k,key)
+  end
+  local err = C.mdb_cursor_get(self,k,nil,op)
+  if err==0 then
+    return val_string(k)
+  elseif err==MDB_NOTFOUND then
+    return nil
+  end
+  return error_and_out(err)
+end
+
+function cursor_methods:put(key,value,flags)
+  return success_or_err(self,C.mdb_cursor_put(self,set_val(k,key),set_val(v,value),flags))
+end
+
+function cursor_methods:del(flags)
+  return success_or_err(self,C.mdb_cursor_del(self,flags))
+end
+
+function cursor_methods:count()
+  local err = C.mdb_cursor_count(self,size_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return tonumber(size_p[0])
+end
+
+ffi.metatype("struct MDB_env",{__index = env_methods})
+ffi.metatype("struct MDB_txn",{__index = txn_methods})
+ffi.metatype("struct MDB_cursor",{__index = cursor_methods})
+
+-- module
+local M = {}
+
+function M.env_create()
+  local err = C.mdb_env_create(env_p)
+  if err~=0 then
+    return error_and_out(err)
+  end
+  return env_p[0]
+end
+
+-- wrap lightningmdb objects
+local function handle(o)
+  local h,err = o:handle()
+  if not h then
+    error(err,3)
+  end
+  return h
+end
+
+function M.env(e)
+  return ffi.cast("MDB_env*",handle(e))
+end
+
+function M.txn(t)
+  return ffi.cast("MDB_txn*",handle(t))
+end
+
+function M.cursor(c)
+  return ffi.cast("MDB_cursor*",handle(c))
+end
+
+return M
@@ -0,0 +1,316 @@
+-- load/stress harness: concurrent reader and writer processes on a single env.
+-- usage: lua stress.lua [--option value ...], see the defaults below.
+-- The coordinator (this process) samples the env while its children run, and
+-- reports throughput and latency percentiles once they are done.
+
+require "test_common"
+
+local defaults = {
+  dir = "./temp/stress",
+  duration = 10,          -- seconds
+  readers = 4,            -- processes
+  writers = 1,            -- processes
+  keys = 100000,          -- key space
+  dist = "uniform",       -- uniform, zipf or seq
+  zipf = 0.99,            -- zipf exponent
+  values = "100:70,1000:25,10000:5", -- value size:weight mix
+  txn = 100,              -- ops per write txn
+  read_txn = 100,         -- gets per read txn
+  del = 10,               -- percentage of dels among the writes
+  mapsize = 1024,         -- MB
+  nosync = 1,             -- open the env with MDB_NOSYNC
+  interval = 1,           -- seconds between samples
+  lua = nil,              -- interpreter running the children
+}
+
+local function parse_args(args)
+  local opts = {}
+  for k,v in pairs(defaults) do
+    opts[k] = v
+  end
+  local i = 1
+  while i<=#args do
+    local name = args[i]:match("^%-%-(.+)$")
+    if not name or args[i+1]==nil then
+      error("bad argument "..args[i])
+    end
+    name = name:gsub("-","_")
+    opts[name] = tonumber(args[i+1]) or args[i+1]
+    i = i + 2
+  end
+  opts.lua = opts.lua or arg[-1] or "lua"
+  return opts
+end
+
+local function open_env(opts)
+  local e = lightningmdb.env_create()
+  e:set_mapsize(opts.mapsize*1024*1024)
+  e:set_maxreaders(opts.readers+opts.writers+8)
+  local flags = opts.nosync==1 and MDB.NOSYNC or 0
+  local ok,err = e:open(opts.dir,flags,420)
+  assert(ok,err)
+  return e
+end
+
+-- key choosers, returning indexes in [0,keys)
+
+local function key_chooser(opts,id,stride)
+  local n = opts.keys
+  if opts.dist=="seq" then
+    local i = id
+    return function()
+      local k = i%n
+      i = i + stride
+      return k
+    end
+  elseif opts.dist=="zipf" then
+    local cdf,sum = {},0
+    for i=1,n do
+      sum = sum + 1/i^opts.zipf
+      cdf[i] = sum
+    end
+    return function()
+      local u = math.random()*sum
+      local lo,hi = 1,n
+      while lo<hi do
+        local mid = math.floor((lo+hi)/2)
+        if cdf[mid]<u then lo = mid+1 else hi = mid end
+      end
+      return lo-1
+    end
+  elseif opts.dist=="uniform" then
+    return function()
+      return math.random(n)-1
+    end
+  end
+  error("unknown distribution "..opts.dist)
+end
+
+local function key_of(i)
+  return string.format("k%010d",i)
+end
+
+local function value_chooser(opts)
+  local sizes,weights,total = {},{},0
+  for size,weight in opts.values:gmatch("(%d+):(%d+)") do
+    sizes[#sizes+1] = string.rep("v",tonumber(size))
+    total = total + tonumber(weight)
+    weights[#weights+1] = total
+  end
+  return function()
+    local u = math.random()*total
+    for i=1,#weights do
+      if u<=weights[i] then
+        return sizes[i]
+      end
+    end
+    return sizes[#sizes]
+  end
+end
+
+-- latency histograms, with 4 buckets per doubling of microseconds
+
+local function hist_add(h,seconds)
+  local us = seconds*1e6
+  local b = us<1 and 0 or math.floor(math.log(us)/math.log(2)*4)
+  h[b] = (h[b] or 0) + 1
+end
+
+local function hist_percentile(h,p)
+  local total,buckets = 0,{}
+  for b,n in pairs(h) do
+    total = total + n
+    buckets[#buckets+1] = b
+  end
+  table.sort(buckets)
+  local seen = 0
+  for _,b in ipairs(buckets) do
+    seen = seen + h[b]
+    if seen>=total*p then
+      return 2^((b+1)/4)
+    end
+  end
+  return 0
+end
+
+-- children, reporting through stdout
+
+local function report(role,ops,txns,errors,h)
+  print(string.format("result %s %d %d %d",role,ops,txns,errors))
+  for b,n in pairs(h) do
+    print(string.format("hist %s %d %d",role,b,n))
+  end
+end
+
+local function reader(opts,id,deadline)
+  local e = open_env(opts)
+  local next_key = key_chooser(opts,id,opts.readers)
+  local clock = lightningmdb.clock
+  local ops,txns,errors,h = 0,0,0,{}
+  local db
+  do
+    local t = e:txn_begin(nil,MDB.RDONLY)
+    db = t:dbi_open(nil,0)
+    t:abort()
+  end
+  while clock()<deadline do
+    local t = e:txn_begin(nil,MDB.RDONLY)
+    for i=1,opts.read_txn do
+      local start = clock()
+      local v,err = t:get(db,key_of(next_key()))
+      hist_add(h,clock()-start)
+      if err then
+        errors = errors + 1
+      end
+      ops = ops + 1
+    end
+    t:abort()
+    txns = txns + 1
+  end
+  e:close()
+  report("read",ops,txns,errors,h)
+end
+
+local function writer(opts,id,deadline)
+  local e = open_env(opts)
+  local next_key = key_chooser(opts,id,opts.writers)
+  local next_value = value_chooser(opts)
+  local clock = lightningmdb.clock
+  local ops,txns,errors,h = 0,0,0,{}
+  local db
+  do
+    local t = e:txn_begin(nil,0)
+    db = t:dbi_open(nil,0)
+    t:commit()
+  end
+  while clock()<deadline do
+    local start = clock()
+    local t = e:txn_begin(nil,0)
+    for i=1,opts.txn do
+      local k = key_of(next_key())
+      if math.random(100)<=opts.del then
+        t:del(db,k,nil)
+      else
+        local ok,err = t:put(db,k,next_value(),0)
+        if not ok then
+          errors = errors + 1
+        end
+      end
+      ops = ops + 1
+    end
+    if not t:commit() then
+      errors = errors + 1
+    end
+    hist_add(h,clock()-start)
+    txns = txns + 1
+  end
+  e:close()
+  report("write",ops,txns,errors,h)
+end
+
+-- coordinator
+
+local function file_size(opts)
+  local f = io.open(opts.dir.."/data.mdb","rb")
+  if not f then
+    return 0
+  end
+  local size = f:seek("end")
+  f:close()
+  return size
+end
+
+local function spawn(opts,role,id,deadline)
+  local args = {}
+  for k,v in pairs(opts) do
+    if k~="lua" then
+      args[#args+1] = string.format("--%s '%s'",k,tostring(v))
+    end
+  end
+  local cmd = string.format("%s stress.lua --role %s --id %d --deadline %.6f %s",
+                            opts.lua,role,id,deadline,table.concat(args," "))
+  return io.popen(cmd,"r")
+end
+
+local function summarize(role,results,duration)
+  local r = results[role]
+  if not r then
+    return
+  end
+  print(string.format("%-5s %10d ops %9d txns %6d errors %12.1f ops/s %10.1f txns/s",
+                      role,r.ops,r.txns,r.errors,r.ops/duration,r.txns/duration))
+  print(string.format("      latency (us, per %s) p50 %.0f p90 %.0f p99 %.0f p99.9 %.0f max %.0f",
+                      role=="read" and "get" or "txn",
+                      hist_percentile(r.hist,0.5),hist_percentile(r.hist,0.9),
+                      hist_percentile(r.hist,0.99),hist_percentile(r.hist,0.999),
+                      hist_percentile(r.hist,1)))
+end
+
+local function coordinate(opts)
+  os.execute("mkdir -p "..opts.dir)
+  os.execute("rm -f "..opts.dir.."/data.mdb "..opts.dir.."/lock.mdb")
+  local e = open_env(opts)
+  local clock = lightningmdb.clock
+  local start = clock()
+  local deadline = start+opts.duration
+
+  local children = {}
+  for i=0,opts.writers-1 do
+    children[#children+1] = spawn(opts,"write",i,deadline)
+  end
+  for i=0,opts.readers-1 do
+    children[#children+1] = spawn(opts,"read",i,deadline)
+  end
+
+  print(string.format("%8s %12s %12s %10s","time","reader slots","last txn","file MB"))
+  local sampled = start
+  while clock()<deadline do
+    os.execute("sleep "..opts.interval)
+    local now = clock()
+    if now-sampled>=opts.interval then
+      local info = e:info()
+      print(string.format("%8.1f %12d %12d %10.1f",now-start,info.me_numreaders,
+                          info.me_last_txnid,file_size(opts)/1048576))
+      sampled = now
+    end
+  end
+
+  local results = {}
+  for _,c in ipairs(children) do
+    for line in c:lines() do
+      local role,ops,txns,errors = line:match("^result (%a+) (%d+) (%d+) (%d+)")
+      local hrole,b,n = line:match("^hist (%a+) (%-?%d+) (%d+)")
+      if role then
+        local r = results[role] or {ops=0,txns=0,errors=0,hist={}}
+        r.ops = r.ops + tonumber(ops)
+        r.txns = r.txns + tonumber(txns)
+        r.errors = r.errors + tonumber(errors)
+        results[role] = r
+      elseif hrole then
+        local r = results[hrole] or {ops=0,txns=0,errors=0,hist={}}
+        r.hist[tonumber(b)] = (r.hist[tonumber(b)] or 0) + tonumber(n)
+        results[hrole] = r
+      else
+        print(line)
+      end
+    end
+    c:close()
+  end
+
+  local duration = clock()-start
+  print(string.format("\n%d writer(s), %d reader(s), %s keys, %.1f s, final file %.1f MB",
+                      opts.writers,opts.readers,opts.dist,duration,file_size(opts)/1048576))
+  summarize("write",results,duration)
+  summarize("read",results,duration)
+  e:close()
+end
+
+local opts = parse_args(arg)
+math.randomseed(os.time()+(opts.id or 0)*7919+(opts.role=="read" and 1 or 0))
+if opts.role=="read" then
+  reader(opts,opts.id,opts.deadline)
+elseif opts.role=="write" then
+  writer(opts,opts.id,opts.deadline)
+else
+  coordinate(opts)
+end
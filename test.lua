@@ -74,7 +74,528 @@ local function grow_db()
   end
 end
 
+local function changes_test()
+  print("--- changes_test ---")
+  local e = lightningmdb.env_create()
+  e:set_maxdbs(4)
+  local dir = test_setup("changes")
+  print(e:open(dir,0,420))
+  print(e:changes_enable())
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  t:put(db,"hello","world",0)
+  t:put(db,"goodbye","world",0)
+  t:del(db,"goodbye",nil)
+  t:commit()
+
+  t = e:txn_begin(nil,0)
+  t:put(db,"aborted","world",0)
+  t:abort()
+
+  -- a nested txn left open is committed along with its parent
+  t = e:txn_begin(nil,0)
+  t:put(db,"parent","world",0)
+  local child = t:begin_nested()
+  child:put(db,"child","world",0)
+  assert(t:commit())
+  assert(not pcall(child.commit,child))
+
+  t = e:txn_begin(nil,0)
+  local dropped = t:dbi_open("dropped",MDB.CREATE)
+  t:put(dropped,"gone","world",0)
+  t:dbi_drop(dropped,0)
+  t:commit()
+
+  local seen,last = 0
+  for seq,id,changes in e:changes_since(0) do
+    for _,c in ipairs(changes) do
+      print(seq,id,c.op,c.name,c.key,c.value)
+      last = c
+    end
+    seen = seen + #changes
+  end
+  assert(seen==7)
+  assert(last.op=="drop" and last.name=="dropped" and last.del==false)
+  e:close()
+end
+
+local function shared_env_test()
+  print("--- shared_env_test ---")
+  local dir = test_setup("shared")
+  local e1 = lightningmdb.env_shared(dir,{mapsize=1048576})
+  local e2 = lightningmdb.env_shared(dir)
+  print(e1,e2)
+
+  local t = e1:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  t:put(db,"hello","world",0)
+  t:commit()
+  e1:close()
+
+  t = e2:txn_begin(nil,MDB.RDONLY)
+  assert(t:get(db,"hello")=="world")
+  t:abort()
+  e2:close()
+
+  -- a file which doesn't exist yet, named in two ways
+  e1 = assert(lightningmdb.env_shared(dir.."/nosubdir",{flags=MDB.NOSUBDIR}))
+  e2 = assert(lightningmdb.env_shared(dir.."/./nosubdir",{flags=MDB.NOSUBDIR}))
+  assert(e1:handle()==e2:handle())
+  e1:close()
+  e2:close()
+end
+
+local function cache_test()
+  print("--- cache_test ---")
+  local e = lightningmdb.env_create()
+  local dir = test_setup("cache")
+  print(e:open(dir,0,420))
+  print(e:cache_enable(16))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  t:put(db,"hello","world",0)
+  t:commit()
+
+  for i=1,3 do
+    t = e:txn_begin(nil,MDB.RDONLY)
+    assert(t:get(db,"hello")=="world")
+    t:abort()
+  end
+
+  t = e:txn_begin(nil,0)
+  t:put(db,"hello","cruel world",0)
+  t:commit()
+
+  t = e:txn_begin(nil,MDB.RDONLY)
+  assert(t:get(db,"hello")=="cruel world")
+  t:abort()
+
+  local stats = e:cache_stats()
+  pt(stats)
+  assert(stats.hits==2 and stats.invalidations==1)
+
+  -- a txn outliving the cache it started with
+  t = e:txn_begin(nil,MDB.RDONLY)
+  e:cache_disable()
+  assert(t:get(db,"hello")=="cruel world")
+  t:abort()
+  e:close()
+end
+
+local function ts_test()
+  print("--- ts_test ---")
+  local e = lightningmdb.env_create()
+  e:set_maxdbs(4)
+  local dir = test_setup("ts")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open("ts",MDB.CREATE+MDB.DUPSORT+MDB.DUPFIXED)
+  for i=1,1000 do
+    assert(t:ts_append(db,"cpu",i*10,i%7))
+  end
+  assert(not t:ts_append(db,"cpu",5,0))
+  t:commit()
+
+  t = e:txn_begin(nil,MDB.RDONLY)
+  local points,n = t:ts_range(db,"cpu",100,199)
+  assert(n==10 and #points==n*16)
+  points,n = t:ts_range(db,"cpu",nil,nil,1000,"count")
+  print("buckets",n)
+  assert(n==11)
+  points,n = t:ts_range(db,"mem",nil,nil)
+  assert(n==0)
+  assert(not pcall(t.ts_range,t,db,"cpu",200,100))
+  assert(not pcall(t.ts_range,t,db,"cpu",nil,nil,0))
+  t:abort()
+  e:close()
+end
+
+local function readahead_test()
+  print("--- readahead_test ---")
+  local e = lightningmdb.env_create()
+  e:set_mapsize(16*1048576)
+  local dir = test_setup("readahead")
+  print(e:open(dir,MDB.NORDAHEAD,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  for i=1,10000 do
+    t:put(db,string.format("%08d",i),string.rep("x",100),MDB.APPEND)
+  end
+  t:commit()
+
+  t = e:txn_begin(nil,MDB.RDONLY)
+  local c = t:cursor_open(db)
+  print(c:readahead(256*1024))
+  local n = 0
+  local k = c:get(nil,MDB.FIRST)
+  while k do
+    n = n + 1
+    k = c:get(nil,MDB.NEXT)
+  end
+  assert(n==10000)
+  c:close()
+  t:abort()
+  e:close()
+end
+
+local function ffi_test()
+  if not jit then
+    return
+  end
+  print("--- ffi_test ---")
+  local lffi = require "lightningmdb.ffi"
+  local e = lightningmdb.env_create()
+  local dir = test_setup("ffi")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local ft = lffi.txn(t)
+  local db = ft:dbi_open(nil,0)
+  for i=1,100 do
+    assert(ft:put(db,"key"..i,"value"..i,0))
+  end
+  t:commit()
+
+  local fe = lffi.env(e)
+  ft = fe:txn_begin(nil,MDB.RDONLY)
+  assert(ft:get(db,"key7")=="value7")
+  local c = ft:cursor_open(db)
+  local n = 0
+  local k = c:get(nil,MDB.FIRST)
+  while k do
+    n = n + 1
+    k = c:get(nil,MDB.NEXT)
+  end
+  assert(n==100)
+  c:close()
+  ft:abort()
+
+  assert(not e:cache_enable(16))
+  e:close()
+
+  e = lightningmdb.env_create()
+  print(e:open(test_setup("ffi_cache"),0,420))
+  assert(e:cache_enable(16))
+  assert(not pcall(lffi.env,e))
+  e:close()
+end
+
+local function savepoint_test()
+  print("--- savepoint_test ---")
+  local e = lightningmdb.env_create()
+  local dir = test_setup("savepoint")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  t:put(db,"kept","1",0)
+  print(t:savepoint(function(child)
+                      assert(child:depth()==1)
+                      child:put(db,"kept too","2",0)
+                    end))
+  print(t:savepoint(function(child)
+                      child:put(db,"undone","3",0)
+                      error("bad batch")
+                    end))
+  local grandchild
+  print(t:savepoint(function(child)
+                      grandchild = child:begin_nested()
+                      grandchild:put(db,"undone too","4",0)
+                      error("bad nested batch")
+                    end))
+  assert(not pcall(grandchild.abort,grandchild))
+  grandchild = nil
+  collectgarbage()
+  assert(t:get(db,"kept too")=="2")
+  assert(t:get(db,"undone")==nil)
+  assert(t:get(db,"undone too")==nil)
+  t:commit()
+
+  -- a cursor keeps its txn alive
+  local c = e:txn_begin(nil,MDB.RDONLY):cursor_open(db)
+  collectgarbage()
+  assert(c:get(nil,MDB.FIRST)=="kept")
+  c:close()
+  e:close()
+end
+
+local function space_test()
+  print("--- space_test ---")
+  local e = lightningmdb.env_create()
+  e:set_maxdbs(4)
+  local dir = test_setup("space")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open("bulk",MDB.CREATE)
+  for i=1,5000 do
+    t:put(db,string.format("%08d",i),string.rep("x",200),0)
+  end
+  t:commit()
+  t = e:txn_begin(nil,0)
+  for i=1,5000 do
+    t:del(db,string.format("%08d",i),nil)
+  end
+  t:commit()
+
+  local report = e:space_report()
+  pt(report)
+  pt(report.dbs)
+  assert(report.free_pages>0 and report.dbs.bulk)
+
+  os.remove(dir.."/compact.mdb")
+  print(e:compact_to(dir.."/compact.mdb"))
+  local size = io.open(dir.."/compact.mdb"):seek("end")
+  assert(size<report.used_pages*report.page_size)
+  e:close()
+
+  -- plain keys in the main dbi, with no room for opening dbis
+  e = lightningmdb.env_create()
+  dir = test_setup("space_plain")
+  print(e:open(dir,0,420))
+  t = e:txn_begin(nil,0)
+  db = t:dbi_open(nil,0)
+  for i=1,100 do
+    t:put(db,"key"..i,"value"..i,0)
+  end
+  t:commit()
+  report = assert(e:space_report())
+  assert(next(report.dbs)==nil and report.main_pages>0)
+  e:close()
+end
+
+local function del_range_test()
+  print("--- del_range_test ---")
+  local e = lightningmdb.env_create()
+  e:set_maxdbs(4)
+  local dir = test_setup("del_range")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open("dups",MDB.CREATE+MDB.DUPSORT)
+  for i=1,100 do
+    t:put(db,string.format("%03d",i),"a",0)
+    t:put(db,string.format("%03d",i),"b",0)
+  end
+  t:commit()
+
+  local total = 0
+  repeat
+    t = e:txn_begin(nil,0)
+    local n,more = t:del_range(db,"010","090",{limit=30})
+    t:commit()
+    total = total + n
+  until not more
+  assert(total==160)
+
+  t = e:txn_begin(nil,0)
+  assert(t:stat(db).ms_entries==40)
+  assert(t:del_range(db,nil,nil)==40)
+  t:commit()
+  e:close()
+end
+
+local function ttl_test()
+  print("--- ttl_test ---")
+  local e = lightningmdb.env_create()
+  e:set_maxdbs(4)
+  local dir = test_setup("ttl")
+  print(e:open(dir,0,420))
+  assert(e:ttl_enable())
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open("sessions",MDB.CREATE)
+  t:put(db,"stale","x",0,{ttl=-1})
+  t:put(db,"fresh","y",0,{ttl=3600})
+  t:put(db,"revived","z",0,{ttl=-1})
+  t:put(db,"revived","z",0)
+  t:put(db,"plain","w",0)
+  assert(t:get(db,"stale")==nil)
+  assert(t:get(db,"fresh")=="y")
+  t:commit()
+
+  assert(e:expire(10)==1)
+  assert(e:expire(10)==0)
+  t = e:txn_begin(nil,MDB.RDONLY)
+  assert(t:stat(db).ms_entries==3)
+  assert(t:get(db,"revived")=="z")
+  t:abort()
+  e:close()
+end
+
+local function merge_test()
+  print("--- merge_test ---")
+  local e = lightningmdb.env_create()
+  e:set_maxdbs(4)
+  local dir = test_setup("merge")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local evens = t:dbi_open("evens",MDB.CREATE)
+  local thirds = t:dbi_open("thirds",MDB.CREATE+MDB.DUPSORT)
+  for i=0,99 do
+    local k = string.format("%03d",i)
+    if i%2==0 then t:put(evens,k,"e"..i,0) end
+    if i%3==0 then
+      t:put(thirds,k,"a",0)
+      t:put(thirds,k,"b",0)
+    end
+  end
+  t:commit()
+
+  t = e:txn_begin(nil,MDB.RDONLY)
+  local n = 0
+  for k,v1,v2 in lightningmdb.intersect(t:cursor_open(evens),t:cursor_open(thirds)) do
+    assert(tonumber(k)%6==0 and v1=="e"..tonumber(k) and v2=="a")
+    n = n + 1
+  end
+  assert(n==17)
+
+  n = 0
+  for k,v1,v2 in lightningmdb.union(t:cursor_open(evens),t:cursor_open(thirds)) do
+    assert((v1~=nil)==(tonumber(k)%2==0) and (v2~=nil)==(tonumber(k)%3==0))
+    n = n + 1
+  end
+  assert(n==67)
+
+  n = 0
+  for k,v1,v2 in lightningmdb.join(t:cursor_open(thirds),t:cursor_open(thirds)) do
+    n = n + 1
+  end
+  assert(n==34*4)
+  t:abort()
+  e:close()
+end
+
+local function alloc_test()
+  print("--- alloc_test ---")
+  local e = lightningmdb.env_create()
+  local dir = test_setup("alloc")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  for i=1,100 do
+    t:put(db,"key"..i,string.rep("v",100+i),0)  -- long strings are never interned
+  end
+  t:commit()
+
+  assert(lightningmdb.alloc_tracking(true))
+  assert(lightningmdb.alloc_reset())
+  t = e:txn_begin(nil,MDB.RDONLY)
+  for i=1,100 do
+    assert(t:get(db,"key"..i))
+  end
+  t:abort()
+  local stats = lightningmdb.alloc_stats()
+  print(stats.current,stats.peak)
+  assert(stats.ops["txn.get"].calls==100)
+  assert(stats.ops["txn.get"].objects>=100)
+  assert(stats.ops["env.txn_begin"].calls==1)
+  assert(stats.peak>=stats.current)
+  assert(lightningmdb.alloc_tracking(false))
+  assert(lightningmdb.alloc_stats()==nil)
+  e:close()
+end
+
+local function sharded_test()
+  print("--- sharded_test ---")
+  local paths = {}
+  for i=1,3 do
+    paths[i] = test_setup("sharded"..i)
+  end
+  local s = lightningmdb.sharded(paths,function(k) return tonumber(k) end)
+  for i=1,99 do
+    s:put(string.format("%03d",i),"v"..i)
+  end
+  assert(s:commit())
+  s:del("050")
+  assert(s:commit())
+  assert(s:get("007")=="v7")
+  assert(s:get("050")==nil)
+
+  local snap = s:snapshot()
+  assert(#snap==3)
+  assert(snap[1]:stat(s:dbi()).ms_entries==33)
+  local n,prev = 0,""
+  for k,v in s:pairs(snap) do
+    assert(k>prev and v=="v"..tonumber(k))
+    prev = k
+    n = n + 1
+  end
+  assert(n==98)
+  n = 0
+  for k in s:pairs(snap,"010","020") do
+    n = n + 1
+  end
+  assert(n==10)
+  for _,t in ipairs(snap) do
+    t:abort()
+  end
+
+  s:put("-5","negative")
+  assert(s:commit())
+  assert(s:get("-5")=="negative")
+  assert(not pcall(s.put,s,"not a number","v"))
+  assert(not pcall(s.put,s,"001",nil))
+  s:close()
+end
+
+local function column_test()
+  print("--- column_test ---")
+  local e = lightningmdb.env_create()
+  local dir = test_setup("column")
+  print(e:open(dir,0,420))
+
+  local t = e:txn_begin(nil,0)
+  local db = t:dbi_open(nil,0)
+  for i=1,100 do
+    t:put(db,string.format("%03d",i),bpack("=did",i,i*2,-i),0)
+  end
+  t:commit()
+
+  t = e:txn_begin(nil,MDB.RDONLY)
+  local c = t:cursor_open(db)
+  local first,n = c:read_column(60,"=did",2)
+  assert(n==60 and #first==60*8)
+  local rest,m = c:read_column(60,"=did",2)
+  assert(m==40)
+  assert(lightningmdb.column_sum(first)+lightningmdb.column_sum(rest)==100*101)
+  assert(lightningmdb.column_min(first)==2)
+  assert(lightningmdb.column_max(rest)==200)
+  c:close()
+
+  c = t:cursor_open(db)
+  local a = c:read_column(100,"=did",1)
+  c:close()
+  c = t:cursor_open(db)
+  local b = c:read_column(100,"=did",3)
+  assert(lightningmdb.column_dot(a,b)==-338350)
+  assert(lightningmdb.column_min("")==nil)
+  c:close()
+  t:abort()
+  e:close()
+end
+
 basic_test()
 grow_db()
+changes_test()
+shared_env_test()
+cache_test()
+ts_test()
+readahead_test()
+ffi_test()
+savepoint_test()
+space_test()
+del_range_test()
+ttl_test()
+merge_test()
+alloc_test()
+sharded_test()
+column_test()
 
 print("\n\n\n**** If you are seeing this, all is good (at least as far as lightningmdb is concerned). ****")